@@ -0,0 +1,169 @@
+/* See LICENSE file for copyright and license details. */
+#include "alloc-check.h"
+
+#ifdef ALLOC_CHECK
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/**
+ * glibc's allocator, that the functions below forward to
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+
+/**
+ * Whether allocations are counted
+ */
+static int counting = 0;
+
+/**
+ * The number of allocations since counting started
+ */
+static uint64_t count = 0;
+
+
+
+void *
+malloc(size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return __libc_realloc(ptr, nmemb * size);
+}
+
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(alignment, size);
+}
+
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(alignment, size);
+}
+
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+	ptr = __libc_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+
+void *
+valloc(size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_valloc(size);
+}
+
+
+void *
+pvalloc(size_t size)
+{
+	if (__atomic_load_n(&counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_pvalloc(size);
+}
+
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+
+/**
+ * Start counting allocations, no allocations
+ * are expected after this function is called
+ */
+void
+alloc_check_start(void)
+{
+	__atomic_store_n(&counting, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Pause counting allocations, for allocations
+ * that are expected in the steady state, until
+ * `alloc_check_start` is called again
+ */
+void
+alloc_check_stop(void)
+{
+	__atomic_store_n(&counting, 0, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Get the number of allocations since
+ * `alloc_check_start` was first called
+ * 
+ * @return  The number of allocations
+ */
+uint64_t
+alloc_check_count(void)
+{
+	return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+
+/*
+ * Counting of memory allocations, to check that no memory
+ * is allocated once the first frame of the fade, or the
+ * first gamma ramps of the steady state, has been applied.
+ * The counting is only compiled in if ALLOC_CHECK is
+ * defined, see config.mk; it replaces malloc(3) and the
+ * other allocation functions, and requires glibc.
+ * Otherwise the functions expand to nothing and no
+ * allocations are counted.
+ * 
+ * The count, which covers the whole process, including
+ * libraries, is reported, and fails, the simulation
+ * selected with -T. This is a manual check, there is
+ * no make target that runs it: build with ALLOC_CHECK
+ * and run, for example, `radharc -T 2026-06-01 -L 50:10`
+ * against a coopgamma server.
+ */
+
+#ifdef ALLOC_CHECK
+
+/**
+ * Start counting allocations, no allocations
+ * are expected after this function is called
+ */
+void alloc_check_start(void);
+
+/**
+ * Pause counting allocations, for allocations
+ * that are expected in the steady state, until
+ * `alloc_check_start` is called again
+ */
+void alloc_check_stop(void);
+
+/**
+ * Get the number of allocations since
+ * `alloc_check_start` was first called
+ * 
+ * @return  The number of allocations
+ */
+uint64_t alloc_check_count(void);
+
+#else
+# define alloc_check_start() ((void)0)
+# define alloc_check_stop() ((void)0)
+#endif
@@ -1,8 +1,13 @@
 /* See LICENSE file for copyright and license details. */
 #include "cg-base.h"
+#include "alloc-check.h"
+#include "metrics.h"
+#include "probes.h"
+#include "recording.h"
 
 #include <libclut.h>
 
+#include <sys/stat.h>
 #include <alloca.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -11,6 +16,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 
 
@@ -20,12 +27,23 @@
 const char *argv0 = NULL;
 
 /**
- * The libcoopgamma context
+ * The selected sites
  */
-libcoopgamma_context_t cg;
+site_t *sites = NULL;
 
 /**
- * The names of the selected CRTC:s
+ * The number of selected sites
+ */
+size_t sites_n = 0;
+
+/**
+ * The libcoopgamma context of the site that
+ * was last used for a failing operation
+ */
+libcoopgamma_context_t *cg = NULL;
+
+/**
+ * The names of the selected CRTC:s, of all sites
  */
 char **crtcs = NULL;
 
@@ -41,7 +59,7 @@ filter_update_t *crtc_updates = NULL;
 libcoopgamma_crtc_info_t *crtc_info = NULL;
 
 /**
- * The number of selected CRTC:s
+ * The number of selected CRTC:s, of all sites
  */
 size_t crtcs_n = 0;
 
@@ -50,6 +68,28 @@ size_t crtcs_n = 0;
  */
 size_t filters_n = 0;
 
+/**
+ * Whether the -v flag (print statistics
+ * to stderr) has been specified
+ */
+int verbose = 0;
+
+/**
+ * Set if a site's CRTC:s have changed when
+ * it was reconnected, `start` shall return 1
+ */
+int crtcs_changed = 0;
+
+/**
+ * Set by the program, in `handle_args`, if the
+ * filters shall only be applied once: each CRTC's
+ * filters are then filled with `fill_oneshot` and
+ * sent as soon as its information has arrived,
+ * `make_slaves` is not used, and `start` is called
+ * with the replies still pending
+ */
+int oneshot = 0;
+
 
 /**
  * Contexts for asynchronous ramp updates
@@ -57,14 +97,63 @@ size_t filters_n = 0;
 static libcoopgamma_async_context_t *asyncs = NULL;
 
 /**
- * The number of pending receives
+ * The number of pending receives, of all sites
  */
 static size_t pending_recvs = 0;
 
 /**
- * Whether message must be flushed
+ * The adjustment method, `NULL` for default
+ */
+static const char *method = NULL;
+
+/**
+ * The time the process started, or
+ * the time the last stage finished
+ */
+static struct timespec last_stage_time;
+
+/**
+ * The time the process started
+ */
+static struct timespec start_time;
+
+/**
+ * The file filter updates are recorded to,
+ * `NULL` unless -w has been specified
+ */
+static FILE *recording = NULL;
+
+/**
+ * The time, on `CLOCK_MONOTONIC`, the recording started
+ */
+static struct timespec recording_start;
+
+
+
+/**
+ * The number of milliseconds to wait before retrying a
+ * failed update, doubled for each consecutive failure
  */
-static int flush_pending = 0;
+#define RETRY_MIN_MS 500
+
+/**
+ * The maximum number of milliseconds to
+ * wait before retrying a failed update
+ */
+#define RETRY_MAX_MS 60000
+
+/**
+ * The number of milliseconds to wait before the second
+ * attempt to reconnect to a site whose connection was
+ * lost, doubled for each failed attempt
+ */
+#define RECONNECT_MIN_MS 10
+
+/**
+ * The maximum number of milliseconds to wait
+ * between attempts to reconnect to a site
+ */
+#define RECONNECT_MAX_MS 5000
 
 
 
@@ -98,6 +187,11 @@ struct crtc_sort_data
 	 */
 	size_t blue_size;
 
+	/**
+	 * The group of the filter
+	 */
+	size_t group;
+
 	/**
 	 * The index of the CRTC
 	 */
@@ -158,6 +252,7 @@ make_slaves(void)
 		data[n].red_size   = crtc_updates[i].filter.ramps.u8.red_size;
 		data[n].green_size = crtc_updates[i].filter.ramps.u8.green_size;
 		data[n].blue_size  = crtc_updates[i].filter.ramps.u8.blue_size;
+		data[n].group      = crtc_updates[i].group;
 		data[n].index      = i;
 		n++;
 	}
@@ -198,307 +293,1847 @@ make_slaves(void)
 
 
 /**
- * Update a filter and synchronise calls
+ * Get the size of a gamma ramp stop
  * 
- * @param   index    The index of the CRTC
- * @param   timeout  The number of milliseconds a call to `poll` may block,
- *                   -1 if it may block forever
- * @return           1: Success, no pending synchronisations
- *                   0: Success, with still pending synchronisations
- *                   -1: Error, `errno` set
- *                   -2: Error, `cg.error` set
+ * @param   depth  The gamma ramp type
+ * @return         The number of bytes in a stop, 0 if
+ *                 the gamma ramp type is unrecognised
+ */
+static size_t
+depth_width(libcoopgamma_depth_t depth)
+{
+	switch (depth) {
+#define X(CONST, MEMBER, MAX, TYPE)\
+	case CONST:\
+		return sizeof(TYPE);
+	LIST_DEPTHS
+#undef X
+	default:
+		return 0;
+	}
+}
+
+
+/**
+ * Calculate the FNV-1a hash of gamma ramps
  * 
- * @throws  EINTR   Call to `poll` was interrupted by a signal
- * @throws  EAGAIN  Call to `poll` timed out
+ * @param   filter  The filter whose gamma ramp sizes and depth
+ *                  the gamma ramps have
+ * @param   ramps   The gamma ramps, `&filter->ramps.u8`
+ *                  for the filter's own gamma ramps
+ * @return          The hash of the gamma ramps
  */
-int
-update_filter(size_t index, int timeout)
+static uint64_t
+hash_ramps(const libcoopgamma_filter_t *filter, const libcoopgamma_ramps8_t *ramps)
 {
-	filter_update_t *filter = crtc_updates + index;
+	const unsigned char *data[3];
+	size_t sizes[3], width = depth_width(filter->depth), i, j;
+	uint64_t hash = UINT64_C(14695981039346656037);
+
+	data[0] = (const void *)ramps->red;
+	data[1] = (const void *)ramps->green;
+	data[2] = (const void *)ramps->blue;
+	sizes[0] = filter->ramps.u8.red_size * width;
+	sizes[1] = filter->ramps.u8.green_size * width;
+	sizes[2] = filter->ramps.u8.blue_size * width;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < sizes[i]; j++) {
+			hash ^= data[i][j];
+			hash *= UINT64_C(1099511628211);
+		}
+	}
+	return hash;
+}
+
+
+/**
+ * Stop recording because the recording could not be written
+ */
+static void
+recording_failed(void)
+{
+	fprintf(stderr, "%s: failed to write recording, recording stopped: %s\n", argv0, strerror(errno));
+	fclose(recording);
+	recording = NULL;
+}
+
+
+/**
+ * Append a record to the recording, if -w has been specified
+ * 
+ * @param  type   The record type, `RECORD_FILTER`, `RECORD_SENT`,
+ *                `RECORD_REPLY`, or `RECORD_FAILED`
+ * @param  index  The index of the filter
+ */
+static void
+record(uint8_t type, size_t index)
+{
+	const libcoopgamma_filter_t *filter = &crtc_updates[index].filter;
+	struct record rec;
+	struct timespec now;
+	size_t crtc_len = 0, class_len = 0;
+
+	if (!recording)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&rec, 0, sizeof(rec));
+	rec.time_ns = (uint64_t)(now.tv_sec - recording_start.tv_sec) * UINT64_C(1000000000);
+	rec.time_ns += (uint64_t)(now.tv_nsec - recording_start.tv_nsec);
+	rec.filter = (uint32_t)index;
+	rec.red_size = (uint32_t)filter->ramps.u8.red_size;
+	rec.green_size = (uint32_t)filter->ramps.u8.green_size;
+	rec.blue_size = (uint32_t)filter->ramps.u8.blue_size;
+	rec.depth = (int8_t)filter->depth;
+	rec.type = type;
+	if (type == RECORD_FILTER) {
+		crtc_len = strlen(filter->crtc);
+		class_len = strlen(filter->class);
+		rec.name_len = (uint16_t)(crtc_len + 1 + class_len);
+		rec.hash = (uint64_t)filter->priority;
+	} else if (type == RECORD_SENT) {
+		rec.hash = hash_ramps(filter, &filter->ramps.u8);
+	}
+
+	if (fwrite(&rec, sizeof(rec), 1, recording) != 1)
+		goto fail;
+	if (type == RECORD_FILTER)
+		if (fwrite(filter->crtc, crtc_len + 1, 1, recording) != 1 ||
+		    fwrite(filter->class, class_len, 1, recording) != 1)
+			goto fail;
+	return;
+
+fail:
+	recording_failed();
+}
+
 
-	if (!filter->synced || filter->failed)
-		abort();
+/**
+ * Send a filter's gamma ramps
+ * 
+ * @param   index  The index of the CRTC
+ * @return         Zero on success, -1 on error
+ */
+static int
+send_filter(size_t index)
+{
+	filter_update_t *filter = crtc_updates + index;
+	site_t *site = sites + filter->site;
 
 	pending_recvs += 1;
 
-	if (libcoopgamma_set_gamma_send(&filter->filter, &cg, asyncs + index) < 0) {
+	METRICS_SENT(index);
+	PROBE2(set_gamma_send, index, filter->filter.crtc);
+	record(RECORD_SENT, index);
+	if (libcoopgamma_set_gamma_send(&filter->filter, &site->cg, asyncs + index) < 0) {
 		switch (errno) {
 		case EINTR:
 		case EAGAIN:
 #if EAGAIN != EWOULDBLOCK
 		case EWOULDBLOCK:
 #endif
-			flush_pending = 1;
+			METRICS_INC(flush_retries);
+			site->flush_pending = 1;
 			break;
 		default:
+			pending_recvs -= 1;
 			return -1;
 		}
 	}
-  
+
 	filter->synced = 0;
-	return synchronise(timeout);
+	filter->hashed = 0;
+	return 0;
 }
 
 
 /**
- * Synchronised calls
+ * Check whether an error means that
+ * the connection to the server was lost
+ * 
+ * @param   err  The error number
+ * @return       1 if the connection was lost, 0 otherwise
+ */
+static int
+is_disconnect(int err)
+{
+	return err == ECONNRESET || err == EPIPE || err == ENOTCONN;
+}
+
+
+/**
+ * Add a number of milliseconds to the current
+ * time on `CLOCK_MONOTONIC`
+ * 
+ * @param  ts        Output parameter for the time
+ * @param  delay_ms  The number of milliseconds
+ */
+static void
+monotonic_after(struct timespec *ts, long int delay_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += delay_ms / 1000;
+	ts->tv_nsec += delay_ms % 1000 * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+
+/**
+ * Check whether a point in time on
+ * `CLOCK_MONOTONIC` has been reached
+ * 
+ * @param   ts  The time
+ * @return      1 if the time has been reached, 0 otherwise
+ */
+static int
+monotonic_reached(const struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+
+/**
+ * Forget the pending replies from a site
+ * whose connection has been lost
+ * 
+ * @param  site  The site
+ */
+static void
+forget_pending(site_t *site)
+{
+	size_t i;
+	for (i = site->filters_offset; i < site->filters_offset + site->filters_n; i++) {
+		if (!crtc_updates[i].synced) {
+			crtc_updates[i].synced = 1;
+			pending_recvs -= 1;
+		}
+	}
+	site->flush_pending = 0;
+}
+
+
+/**
+ * Make one attempt to reconnect to a site whose
+ * coopgamma server has closed the connection,
+ * and resend the site's current filters
+ * 
+ * If the attempt fails, the site is marked as
+ * disconnected and the next attempt is scheduled,
+ * with exponential backoff; it is made by
+ * `update_filter` or `retry_filters`
+ * 
+ * If the site's CRTC:s have changed, nothing
+ * is resent and `crtcs_changed` is set
+ * 
+ * @param   site  The site
+ * @return        0: Success, even if the attempt failed
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ */
+static int
+reconnect_site(site_t *site)
+{
+	long int delay_ms = RECONNECT_MIN_MS;
+	char **fresh;
+	size_t i, n;
+	unsigned int k;
+
+	if (!site->disconnected) {
+		if (verbose) {
+			fprintf(stderr, "%s: connection to coopgamma server lost%s%s, reconnecting\n", argv0,
+			        site->name ? " for site " : "", site->name ? site->name : "");
+		}
+		site->disconnected = 1;
+		site->reconnect_attempts = 0;
+	}
+
+	forget_pending(site);
+	if (site->stage >= 1)
+		libcoopgamma_context_destroy(&site->cg, site->stage >= 2);
+	site->stage = 0;
+
+	if (libcoopgamma_context_initialise(&site->cg) < 0)
+		return -1;
+	site->stage = 1;
+	if (libcoopgamma_connect(method, site->name, &site->cg) < 0)
+		goto retry;
+	site->stage = 2;
+
+	fresh = libcoopgamma_get_crtcs_sync(&site->cg);
+	if (!fresh) {
+		if (!errno) {
+			cg = &site->cg;
+			return -2;
+		} else if (is_disconnect(errno)) {
+			goto retry;
+		}
+		return -1;
+	}
+	for (n = 0; fresh[n]; n++);
+	if (n != site->crtcs_n)
+		crtcs_changed = 1;
+	for (i = 0; i < n && !crtcs_changed; i++)
+		if (strcmp(fresh[i], site->crtcs[i]))
+			crtcs_changed = 1;
+	free(fresh);
+
+	if (libcoopgamma_set_nonblocking(&site->cg, 1) < 0)
+		return -1;
+	site->disconnected = 0;
+	if (crtcs_changed) {
+		if (site->cache_path)
+			unlink(site->cache_path);
+		goto done;
+	}
+
+	for (i = site->filters_offset; i < site->filters_offset + site->filters_n; i++) {
+		if (crtc_updates[i].failed || !crtc_info[crtc_updates[i].crtc].supported)
+			continue;
+		if (send_filter(i) < 0) {
+			if (!is_disconnect(errno))
+				return -1;
+			site->disconnected = 1;
+			forget_pending(site);
+			goto retry;
+		}
+	}
+
+done:
+	if (verbose) {
+		fprintf(stderr, "%s: reconnected to coopgamma server%s%s%s\n", argv0,
+		        site->name ? " for site " : "", site->name ? site->name : "",
+		        crtcs_changed ? ", CRTC:s have changed" : "");
+	}
+	return 0;
+
+retry:
+	site->reconnect_attempts += 1;
+	for (k = 1; k < site->reconnect_attempts && delay_ms < RECONNECT_MAX_MS; k++)
+		delay_ms *= 2;
+	if (delay_ms > RECONNECT_MAX_MS)
+		delay_ms = RECONNECT_MAX_MS;
+	monotonic_after(&site->reconnect_at, delay_ms);
+	if (verbose) {
+		fprintf(stderr, "%s: could not reconnect to coopgamma server%s%s, retrying in %li ms\n", argv0,
+		        site->name ? " for site " : "", site->name ? site->name : "", delay_ms);
+	}
+	return 0;
+}
+
+
+/**
+ * Update a filter and synchronise calls
+ * 
+ * If the connection to the server is lost, it is
+ * reestablished and all filters on the site are resent;
+ * filters that have thereby already been resent, and
+ * filters on a site that is waiting to be reconnected,
+ * are skipped
  * 
+ * If the filter has failed, it is skipped until
+ * it may be retried
+ * 
+ * @param   index    The index of the CRTC
  * @param   timeout  The number of milliseconds a call to `poll` may block,
  *                   -1 if it may block forever
  * @return           1: Success, no pending synchronisations
  *                   0: Success, with still pending synchronisations
  *                   -1: Error, `errno` set
- *                   -2: Error, `cg.error` set
+ *                   -2: Error, `cg->error` set
  * 
  * @throws  EINTR   Call to `poll` was interrupted by a signal
  * @throws  EAGAIN  Call to `poll` timed out
  */
 int
-synchronise(int timeout)
+update_filter(size_t index, int timeout)
 {
-	struct pollfd pollfd;
-	size_t selected;
+	filter_update_t *filter = crtc_updates + index;
+	site_t *site = sites + filter->site;
+	int r;
 
-	pollfd.fd = cg.fd;
-	pollfd.events = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
-	if (flush_pending > 0)
-		pollfd.events |= POLLOUT;
+	/* The filter's current gamma ramps have already been
+	 * resent, when its site was reconnected after the
+	 * caller sent or synchronised an earlier filter */
+	if (!filter->synced)
+		return !pending_recvs;
 
-	pollfd.revents = 0;
-	if (poll(&pollfd, (nfds_t)1, timeout) < 0)
-		return -1;
+	if (crtcs_changed)
+		return !pending_recvs;
 
-	if (pollfd.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL)) {
-		if (libcoopgamma_flush(&cg) < 0)
-			goto sync;
-		flush_pending = 0;
+	if (site->disconnected) {
+		if (!monotonic_reached(&site->reconnect_at))
+			return !pending_recvs;
+		if ((r = reconnect_site(site)) < 0)
+			return r;
+		return synchronise(timeout);
 	}
 
-	if (timeout < 0 && pending_recvs > 0) {
-		if (!(pollfd.revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI))) {
-			pollfd.revents = 0;
-			if (poll(&pollfd, (nfds_t)1, -1) < 0)
-				return -1;
+	if (filter->failed) {
+		if (!monotonic_reached(&filter->retry_at))
+			return !pending_recvs;
+		filter->failed = 0;
+	}
+
+	if (send_filter(index) < 0) {
+		if (!is_disconnect(errno))
+			return -1;
+		if ((r = reconnect_site(site)) < 0)
+			return r;
+	}
+
+	return synchronise(timeout);
+}
+
+
+/**
+ * Get the number of milliseconds until a
+ * point in time on `CLOCK_MONOTONIC`
+ * 
+ * @param   ts   The time
+ * @param   now  The current time on `CLOCK_MONOTONIC`
+ * @return       The number of milliseconds, 0 if the time has passed
+ */
+static long int
+monotonic_until(const struct timespec *ts, const struct timespec *now)
+{
+	long int ms = (long int)(ts->tv_sec - now->tv_sec) * 1000;
+	ms += (ts->tv_nsec - now->tv_nsec + 999999L) / 1000000L;
+	return ms < 0 ? 0 : ms;
+}
+
+
+/**
+ * Get the time until the next scheduled retry of a
+ * failed filter update, or attempt to reconnect
+ * to a site whose connection was lost
+ * 
+ * @return  The number of milliseconds until the retry,
+ *          0 if it is due, -1 if none is scheduled
+ */
+int
+retry_delay(void)
+{
+	struct timespec now;
+	long int ms, min = -1;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < sites_n; i++) {
+		if (!sites[i].disconnected)
+			continue;
+		ms = monotonic_until(&sites[i].reconnect_at, &now);
+		if (min < 0 || ms < min)
+			min = ms;
+	}
+	for (i = 0; i < filters_n; i++) {
+		if (!crtc_updates[i].failed || sites[crtc_updates[i].site].disconnected)
+			continue;
+		ms = monotonic_until(&crtc_updates[i].retry_at, &now);
+		if (min < 0 || ms < min)
+			min = ms;
+	}
+	return (int)min;
+}
+
+
+/**
+ * Retry the failed filter updates, and make the
+ * attempts to reconnect to sites whose connection
+ * was lost, that are due, and wait until the
+ * resent filters have been replied
+ * 
+ * Must not be called while there are pending synchronisations
+ * 
+ * @return  0: Success
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+int
+retry_filters(void)
+{
+	size_t i;
+	int r = 1;
+
+	for (i = 0; i < filters_n; i++) {
+		if (!crtc_updates[i].failed && !sites[crtc_updates[i].site].disconnected)
+			continue;
+		r = update_filter(i, 0);
+		if (r == -2 || (r == -1 && errno != EAGAIN))
+			return r;
+	}
+
+	while (r != 1)
+		if ((r = synchronise(-1)) < 0)
+			return r;
+	return 0;
+}
+
+
+/**
+ * Print the error of a failed filter update
+ * 
+ * @param  filter  The filter
+ */
+static void
+print_filter_error(const filter_update_t *filter)
+{
+	const libcoopgamma_error_t *error = &filter->error;
+	const char *side = error->server_side ? "server" : "client";
+	const char *crtc = filter->filter.crtc;
+	if (error->custom) {
+		if (error->number && error->description) {
+			fprintf(stderr, "%s: %s-side error number %" PRIu64 " for CRTC %s: %s\n",
+			        argv0, side, error->number, crtc, error->description);
+		} else if (error->number) {
+			fprintf(stderr, "%s: %s-side error number %" PRIu64 " for CRTC %s\n",
+			        argv0, side, error->number, crtc);
+		} else if (error->description) {
+			fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
+			        argv0, side, crtc, error->description);
 		}
+	} else if (error->description) {
+		fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
+		        argv0, side, crtc, error->description);
+	} else {
+		fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
+		        argv0, side, crtc, strerror((int)error->number));
 	}
+}
 
- sync:
-	if (pollfd.revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLERR | POLLHUP | POLLNVAL)) {
-		for (;;) {
-			if (libcoopgamma_synchronise(&cg, asyncs, filters_n, &selected) < 0) {
-				if (!errno)
-					continue;
-				goto fail;
-			}
-			if (crtc_updates[selected].synced)
-				continue;
-			crtc_updates[selected].synced = 1;
-			pending_recvs -= 1;
-			if (libcoopgamma_set_gamma_recv(&cg, asyncs + selected) < 0) {
-				if (cg.error.server_side) {
-					crtc_updates[selected].error = cg.error;
-					crtc_updates[selected].failed = 1;
-					memset(&cg.error, 0, sizeof(cg.error));
-				} else {
-					goto cg_fail;
-				}
-			}
+
+/**
+ * Mark a filter update as failed, and schedule a
+ * retry with exponential backoff; the error is
+ * reported on the first consecutive failure, and
+ * on every failure if -v has been specified
+ * 
+ * @param  filter  The filter, with `.error` set
+ */
+static void
+filter_failed(filter_update_t *filter)
+{
+	long int delay_ms = RETRY_MAX_MS;
+	unsigned int i;
+
+	filter->failed = 1;
+	filter->failures += 1;
+	filter->consecutive_failures += 1;
+
+	if (filter->consecutive_failures < 32) {
+		delay_ms = RETRY_MIN_MS;
+		for (i = 1; i < filter->consecutive_failures && delay_ms < RETRY_MAX_MS; i++)
+			delay_ms *= 2;
+		if (delay_ms > RETRY_MAX_MS)
+			delay_ms = RETRY_MAX_MS;
+	}
+
+	monotonic_after(&filter->retry_at, delay_ms);
+
+	if (filter->consecutive_failures == 1 || verbose) {
+		print_filter_error(filter);
+		if (verbose) {
+			fprintf(stderr, "%s: retrying CRTC %s in %li ms (%" PRIu64 " failures)\n",
+			        argv0, filter->filter.crtc, delay_ms, filter->failures);
 		}
 	}
+}
 
-	return !pending_recvs;
-cg_fail:
-	return -2;
-fail:
-	switch (errno) {
-	case EINTR:
+
+/**
+ * Mark a filter update as succeeded, and report,
+ * if it had failed, that it has recovered; this is
+ * reported even without -v, as the first failure was
+ * 
+ * @param  filter  The filter
+ */
+static void
+filter_succeeded(filter_update_t *filter)
+{
+	unsigned int failures = filter->consecutive_failures;
+	filter->consecutive_failures = 0;
+	if (!failures)
+		return;
+	if (verbose) {
+		fprintf(stderr, "%s: CRTC %s has recovered after %u failures\n",
+		        argv0, filter->filter.crtc, failures);
+	} else {
+		fprintf(stderr, "%s: CRTC %s has recovered\n", argv0, filter->filter.crtc);
+	}
+}
+
+
+/**
+ * Receive the reply to a filter update
+ * 
+ * @param   site   The filter's site
+ * @param   index  The index of the filter, the
+ *                 update must not be synchronised
+ * @return         0: Success, even if the server
+ *                    reported that the update failed
+ *                 -2: Error, `cg->error` set
+ */
+static int
+receive_filter(site_t *site, size_t index)
+{
+	crtc_updates[index].synced = 1;
+	pending_recvs -= 1;
+	METRICS_RECEIVED(index);
+	if (libcoopgamma_set_gamma_recv(&site->cg, asyncs + index) < 0) {
+		PROBE2(set_gamma_reply, index, 1);
+		if (site->cg.error.server_side) {
+			METRICS_INC(server_failures);
+			record(RECORD_FAILED, index);
+			libcoopgamma_error_destroy(&crtc_updates[index].error);
+			crtc_updates[index].error = site->cg.error;
+			memset(&site->cg.error, 0, sizeof(site->cg.error));
+			filter_failed(&crtc_updates[index]);
+		} else {
+			cg = &site->cg;
+			return -2;
+		}
+	} else {
+		PROBE2(set_gamma_reply, index, 0);
+		record(RECORD_REPLY, index);
+		filter_succeeded(&crtc_updates[index]);
+	}
+	if (recording && !pending_recvs && fflush(recording))
+		recording_failed();
+	return 0;
+}
+
+
+/**
+ * Receive all available replies from a site
+ * 
+ * @param   site  The site
+ * @return        0: Success
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ */
+static int
+synchronise_site(site_t *site)
+{
+	size_t selected;
+
+	for (;;) {
+		if (libcoopgamma_synchronise(&site->cg, asyncs + site->filters_offset, site->filters_n, &selected) < 0) {
+			if (!errno)
+				continue;
+			goto fail;
+		}
+		selected += site->filters_offset;
+		if (crtc_updates[selected].synced)
+			continue;
+		if (receive_filter(site, selected) < 0)
+			return -2;
+	}
+
+fail:
+	switch (errno) {
+	case EINTR:
 	case EAGAIN:
 #if EAGAIN != EWOULDBLOCK
 	case EWOULDBLOCK:
 #endif
-		return !pending_recvs;
-	default:
-		return -1;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * Synchronised calls
+ * 
+ * If the connection to a server is lost, it is
+ * reestablished and all filters on the site are resent
+ * 
+ * @param   timeout  The number of milliseconds a call to `poll` may block,
+ *                   -1 if it may block forever
+ * @return           1: Success, no pending synchronisations
+ *                   0: Success, with still pending synchronisations
+ *                   -1: Error, `errno` set
+ *                   -2: Error, `cg->error` set
+ * 
+ * @throws  EINTR   Call to `poll` was interrupted by a signal
+ * @throws  EAGAIN  Call to `poll` timed out
+ */
+int
+synchronise(int timeout)
+{
+	struct pollfd *pollfds;
+	size_t i;
+	int r, have_input = 0;
+
+	pollfds = alloca(sites_n * sizeof(*pollfds));
+	for (i = 0; i < sites_n; i++) {
+		pollfds[i].fd = sites[i].disconnected ? -1 : sites[i].cg.fd;
+		pollfds[i].events = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
+		if (sites[i].flush_pending > 0)
+			pollfds[i].events |= POLLOUT;
+		pollfds[i].revents = 0;
+	}
+
+	if (poll(pollfds, (nfds_t)sites_n, timeout) < 0)
+		return -1;
+	METRICS_INC(wakeups);
+
+	for (i = 0; i < sites_n; i++) {
+		if (pollfds[i].revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL)) {
+			if (libcoopgamma_flush(&sites[i].cg) < 0) {
+				switch (errno) {
+				case EINTR:
+				case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+				case EWOULDBLOCK:
+#endif
+					METRICS_INC(flush_retries);
+					break;
+				}
+				have_input = 1;
+				continue;
+			}
+			sites[i].flush_pending = 0;
+		}
+		if (pollfds[i].revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI))
+			have_input = 1;
+	}
+
+	if (timeout < 0 && pending_recvs > 0 && !have_input) {
+		for (i = 0; i < sites_n; i++) {
+			pollfds[i].events &= ~POLLOUT;
+			pollfds[i].revents = 0;
+		}
+		if (poll(pollfds, (nfds_t)sites_n, -1) < 0)
+			return -1;
+		METRICS_INC(wakeups);
+	}
+
+	for (i = 0; i < sites_n; i++) {
+		if (pollfds[i].revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLERR | POLLHUP | POLLNVAL)) {
+			r = synchronise_site(&sites[i]);
+			if (r == -1 && is_disconnect(errno))
+				r = reconnect_site(&sites[i]);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	return !pending_recvs;
+}
+
+
+/**
+ * Initialise the process, specifically reset the signal mask
+ * and signal handlers, and ignore SIGPIPE so that a lost
+ * connection to the server can be recovered from
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+initialise_proc(void)
+{
+	sigset_t sigmask;
+	int sig;
+
+	for (sig = 1; sig < _NSIG; sig++)
+		if (signal(sig, SIG_DFL) == SIG_ERR)
+			if (sig == SIGCHLD)
+				return -1;
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return -1;
+
+	if (sigemptyset(&sigmask) < 0)
+		return -1;
+	if (sigprocmask(SIG_SETMASK, &sigmask, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Print, to stdout, a list of all
+ * recognised adjustment methods
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+list_methods(void)
+{
+	char **list;
+	size_t i;
+
+	list = libcoopgamma_get_methods();
+	if (!list)
+		return -1;
+	for (i = 0; list[i]; i++)
+		printf("%s\n", list[i]);
+	free(list);
+	if (fflush(stdout) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Print, to stdout, a list of all CRTC:s of a site
+ * 
+ * A connection to the coopgamma server
+ * must have been made
+ * 
+ * @param   site  The site
+ * @return        Zero on success, -1 on error, -2
+ *                on libcoopgamma error
+ */
+static int
+list_crtcs(site_t *site)
+{
+	char **list;
+	size_t i;
+
+	list = libcoopgamma_get_crtcs_sync(&site->cg);
+	if (!list) {
+		cg = &site->cg;
+		return -2;
+	}
+	for (i = 0; list[i]; i++)
+		printf("%s\n", list[i]);
+	free(list);
+	if (fflush(stdout) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Fill the list of CRTC information for a site
+ * 
+ * @param   site  The site
+ * @param   info  Output parameter for the CRTC information,
+ *                one element per CRTC in `site->crtcs`
+ * @return        Zero on success, -1 on error, -2
+ *                on libcoopgamma error
+ */
+static int
+get_crtc_info(site_t *site, libcoopgamma_crtc_info_t *info)
+{
+	size_t i, unsynced = 0, selected, crtcs_n = site->crtcs_n;
+	libcoopgamma_async_context_t *site_asyncs = asyncs + site->filters_offset;
+	char **crtcs = site->crtcs;
+	char *synced;
+	int need_flush = 0;
+	struct pollfd pollfd;
+
+	synced = alloca(crtcs_n * sizeof(*synced));
+	memset(synced, 0, crtcs_n * sizeof(*synced));
+
+	i = 0;
+	pollfd.fd = site->cg.fd;
+	pollfd.events = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
+
+	while (unsynced > 0 || i < crtcs_n) {
+	wait:
+		if (i < crtcs_n)
+			pollfd.events |= POLLOUT;
+		else
+			pollfd.events &= ~POLLOUT;
+      
+		pollfd.revents = 0;
+		if (poll(&pollfd, (nfds_t)1, -1) < 0)
+			goto fail;
+      
+		if (pollfd.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL)) {
+			if (need_flush && (libcoopgamma_flush(&site->cg) < 0))
+				goto send_fail;
+			need_flush = 0;
+			for (; i < crtcs_n; i++)
+				if (unsynced++, libcoopgamma_get_gamma_info_send(crtcs[i], &site->cg, site_asyncs + i) < 0)
+					goto send_fail;
+			goto send_done;
+		send_fail:
+			switch (errno) {
+			case EINTR:
+			case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+			case EWOULDBLOCK:
+#endif
+				i++;
+				need_flush = 1;
+				break;
+			default:
+				goto fail;
+			}
+		}
+	send_done:
+
+		if (!unsynced && i == crtcs_n)
+			break;
+      
+		if (pollfd.revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI)) {
+			while (unsynced > 0) {
+				switch (libcoopgamma_synchronise(&site->cg, site_asyncs, i, &selected)) {
+				case 0:
+					if (synced[selected]) {
+						libcoopgamma_skip_message(&site->cg);
+						break;
+					}
+					synced[selected] = 1;
+					unsynced -= 1;
+					if (libcoopgamma_get_gamma_info_recv(info + selected, &site->cg, site_asyncs + selected) < 0)
+						goto cg_fail;
+					break;
+				case -1:
+					switch (errno)
+						{
+						case 0:
+							break;
+						case EINTR:
+						case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+						case EWOULDBLOCK:
+#endif
+							goto wait;
+						default:
+							goto fail;
+						}
+					break;
+				}
+			}
+		}
+	}
+
+	return 0;
+fail:
+	return -1;
+cg_fail:
+	cg = &site->cg;
+	return -2;
+}
+
+
+/**
+ * Initialise a filter with an identity ramp
+ * 
+ * @param   index     The index of the filter
+ * @param   crtc      The index of the filter's CRTC,
+ *                    whose information must be available
+ * @param   site      The index of the filter's site
+ * @param   class     The filter's class
+ * @param   priority  The filter's priority
+ * @return            Zero on success, -1 on error, -3
+ *                    on error with message already printed
+ */
+static int
+initialise_filter(size_t index, size_t crtc, size_t site, char *class, int64_t priority)
+{
+	filter_update_t *update = &crtc_updates[index];
+
+	if (libcoopgamma_filter_initialise(&update->filter) < 0)
+		return -1;
+	if (libcoopgamma_error_initialise(&update->error) < 0)
+		return -1;
+	update->crtc = crtc;
+	update->site = site;
+	update->synced = 1;
+	update->failed = 0;
+	update->master = 1;
+	update->slaves = NULL;
+	update->filter.crtc                = crtcs[crtc];
+	update->filter.class               = class;
+	update->filter.priority            = priority;
+	update->filter.depth               = crtc_info[crtc].depth;
+	update->filter.ramps.u8.red_size   = crtc_info[crtc].red_size;
+	update->filter.ramps.u8.green_size = crtc_info[crtc].green_size;
+	update->filter.ramps.u8.blue_size  = crtc_info[crtc].blue_size;
+	switch (update->filter.depth) {
+#define X(CONST, MEMBER, MAX, TYPE)\
+	case CONST:\
+		libcoopgamma_ramps_initialise(&update->filter.ramps.MEMBER);\
+		libclut_start_over(&update->filter.ramps.MEMBER, MAX, TYPE, 1, 1, 1);\
+		break;
+	LIST_DEPTHS
+#undef X
+	default:
+		fprintf(stderr, "%s: internal error: gamma ramp type is unrecognised: %i\n",
+		        argv0, update->filter.depth);
+		return -3;
+	}
+
+	record(RECORD_FILTER, index);
+	return 0;
+}
+
+
+/**
+ * Initialise, fill with `fill_oneshot`, and send
+ * the filters of a CRTC whose information is available
+ * 
+ * @param   site_i     The index of the site
+ * @param   crtc_i     The index of the CRTC within the site
+ * @param   classes    The classes of the filters
+ * @param   classes_n  The number of elements in `classes`
+ * @param   priority   The filters' priority
+ * @return             Zero on success, -1 on error, -3
+ *                     on error with message already printed
+ */
+static int
+send_crtc_oneshot(size_t site_i, size_t crtc_i, char **classes, size_t classes_n, int64_t priority)
+{
+	site_t *site = &sites[site_i];
+	size_t i, index, crtc = site->crtcs_offset + crtc_i;
+	int r;
+
+	for (i = 0; i < classes_n; i++) {
+		index = site->filters_offset + i * site->crtcs_n + crtc_i;
+		if ((r = initialise_filter(index, crtc, site_i, classes[i], priority)) < 0)
+			return r;
+		if (!crtc_info[crtc].supported)
+			continue;
+		fill_oneshot(index);
+		if (send_filter(index) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Apply the filters of a site, when `oneshot` is set
+ * 
+ * The CRTC information is queried, unless it was loaded
+ * from the cache, and each CRTC's filters are sent as
+ * soon as its information has arrived, so that the
+ * queries and the updates are pipelined
+ * 
+ * Replies to the updates that arrive while the CRTC
+ * information is received are received, the others
+ * are left pending for `synchronise`
+ * 
+ * @param   site_i     The index of the site
+ * @param   classes    The classes of the filters
+ * @param   classes_n  The number of elements in `classes`
+ * @param   priority   The filters' priority
+ * @return             0: Success
+ *                     -1: Error, `errno` set
+ *                     -2: Error, `cg->error` set
+ *                     -3: Error, message already printed
+ */
+static int
+apply_oneshot(size_t site_i, char **classes, size_t classes_n, int64_t priority)
+{
+	site_t *site = &sites[site_i];
+	size_t i, unsynced = 0, selected, crtcs_n = site->crtcs_n;
+	libcoopgamma_async_context_t *site_asyncs = asyncs + site->filters_offset;
+	libcoopgamma_crtc_info_t *info = &crtc_info[site->crtcs_offset];
+	char *queried;
+	int r, need_flush = 0;
+	struct pollfd pollfd;
+
+	if (site->from_cache) {
+		for (i = 0; i < crtcs_n; i++)
+			if ((r = send_crtc_oneshot(site_i, i, classes, classes_n, priority)) < 0)
+				return r;
+		return 0;
+	}
+
+	queried = alloca(crtcs_n * sizeof(*queried));
+	memset(queried, 0, crtcs_n * sizeof(*queried));
+
+	i = 0;
+	pollfd.fd = site->cg.fd;
+	pollfd.events = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
+
+	while (unsynced > 0 || i < crtcs_n) {
+	wait:
+		if (i < crtcs_n || site->flush_pending)
+			pollfd.events |= POLLOUT;
+		else
+			pollfd.events &= ~POLLOUT;
+
+		pollfd.revents = 0;
+		if (poll(&pollfd, (nfds_t)1, -1) < 0)
+			goto fail;
+
+		if (pollfd.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL)) {
+			if ((need_flush || site->flush_pending) && (libcoopgamma_flush(&site->cg) < 0))
+				goto send_fail;
+			need_flush = 0;
+			site->flush_pending = 0;
+			for (; i < crtcs_n; i++)
+				if (queried[i] = 1, unsynced++, libcoopgamma_get_gamma_info_send(site->crtcs[i], &site->cg, site_asyncs + i) < 0)
+					goto send_fail;
+			goto send_done;
+		send_fail:
+			switch (errno) {
+			case EINTR:
+			case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+			case EWOULDBLOCK:
+#endif
+				if (i < crtcs_n && queried[i])
+					i++;
+				need_flush = 1;
+				break;
+			default:
+				goto fail;
+			}
+		}
+	send_done:
+
+		if (!unsynced && i == crtcs_n)
+			break;
+
+		if (pollfd.revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI)) {
+			while (unsynced > 0) {
+				switch (libcoopgamma_synchronise(&site->cg, site_asyncs, site->filters_n, &selected)) {
+				case 0:
+					if (selected < crtcs_n && queried[selected] == 1) {
+						queried[selected] = 2;
+						unsynced -= 1;
+						if (libcoopgamma_get_gamma_info_recv(info + selected, &site->cg, site_asyncs + selected) < 0)
+							goto cg_fail;
+						if ((r = send_crtc_oneshot(site_i, selected, classes, classes_n, priority)) < 0)
+							return r;
+					} else if (!crtc_updates[site->filters_offset + selected].synced) {
+						if (receive_filter(site, site->filters_offset + selected) < 0)
+							return -2;
+					} else {
+						libcoopgamma_skip_message(&site->cg);
+					}
+					break;
+				case -1:
+					switch (errno) {
+					case 0:
+						break;
+					case EINTR:
+					case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+					case EWOULDBLOCK:
+#endif
+						goto wait;
+					default:
+						goto fail;
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	return 0;
+fail:
+	return -1;
+cg_fail:
+	cg = &site->cg;
+	return -2;
+}
+
+
+/**
+ * Get the number of milliseconds between two points in time
+ * 
+ * @param   a  The earlier point in time
+ * @param   b  The later point in time
+ * @return     The number of milliseconds from `a` to `b`
+ */
+static double
+elapsed_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (double)(b->tv_sec - a->tv_sec) * 1000 + (double)(b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+
+/**
+ * Report, if -v has been specified, that a
+ * startup stage has finished and how long it took
+ * 
+ * @param  stage  The name of the stage
+ */
+void
+stage_done(const char *stage)
+{
+	struct timespec now;
+	if (!verbose)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "%s: %s: %.3f ms (%.3f ms since start)\n", argv0, stage,
+	        elapsed_ms(&last_stage_time, &now), elapsed_ms(&start_time, &now));
+	last_stage_time = now;
+}
+
+
+/**
+ * Get the pathname of the CRTC information cache file
+ * 
+ * The file is stored in the directory named after the first
+ * part of the default class, inside $XDG_CACHE_HOME, or
+ * ~/.cache if $XDG_CACHE_HOME is not set, and is named
+ * after a hash of the adjustment method and site
+ * 
+ * @param   method  The adjustment method, `NULL` for default
+ * @param   site    The site, `NULL` for default
+ * @return          The pathname, `NULL` on error or if
+ *                  no cache directory is available
+ */
+static char *
+get_crtc_cache_path(const char *method, const char *site)
+{
+	const char *dir, *suffix = "", *prog_end;
+	uint64_t hash = UINT64_C(14695981039346656037);
+	const char *key[2];
+	size_t i, prog_len;
+	const char *c;
+	char *path;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (!dir || !*dir) {
+		dir = getenv("HOME");
+		suffix = "/.cache";
+		if (!dir || !*dir)
+			return NULL;
+	}
+
+	key[0] = method ? method : "";
+	key[1] = site ? site : "";
+	for (i = 0; i < 2; i++) {
+		for (c = key[i]; *c; c++)
+			hash = (hash ^ (uint8_t)*c) * UINT64_C(1099511628211);
+		hash = (hash ^ (uint8_t)(method ? 1 : 0) ^ (uint8_t)(site ? 2 : 0)) * UINT64_C(1099511628211);
+	}
+
+	prog_end = strstr(default_class, "::");
+	prog_len = (size_t)(prog_end - default_class);
+
+	path = malloc(strlen(dir) + strlen(suffix) + prog_len + sizeof("//crtc-info-") + 16);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s%s/%.*s/crtc-info-%016" PRIx64, dir, suffix, (int)prog_len, default_class, hash);
+	return path;
+}
+
+
+/**
+ * Load a site's CRTC names and CRTC information from the cache
+ * 
+ * On success, `site->crtcs` is set to a list, allocated as
+ * one `malloc` block, that shall be freed with `free`,
+ * `site->crtcs_n` is set, and `site->cached_info` is set
+ * to a `malloc` allocated array of `site->crtcs_n` CRTC
+ * information
+ * 
+ * @param   method  The adjustment method, `NULL` for default
+ * @param   site    The site
+ * @return          1 if the cache was loaded, 0 if there is no
+ *                  usable cache, -1 on error
+ */
+static int
+load_crtc_cache(const char *method, site_t *site)
+{
+	FILE *f;
+	char *line = NULL, *names = NULL, *name;
+	size_t size = 0, n = 0, names_size = 0, i;
+	ssize_t len;
+	libcoopgamma_crtc_info_t *info = NULL, *new_info, *ci;
+	int saved_errno, cooperative, depth, supported, colourspace, have_gamut, off;
+	unsigned long int red_size, green_size, blue_size;
+	char **list;
+
+	f = fopen(site->cache_path, "r");
+	if (!f)
+		return errno == ENOMEM ? -1 : 0;
+
+	len = getline(&line, &size, f);
+	if (len <= 0 || line[len - 1] != '\n' || strncmp(line, "M:", 2))
+		goto unusable;
+	line[len - 1] = '\0';
+	if (method ? strcmp(&line[2], method) : !!line[2])
+		goto unusable;
+	len = getline(&line, &size, f);
+	if (len <= 0 || line[len - 1] != '\n' || strncmp(line, "S:", 2))
+		goto unusable;
+	line[len - 1] = '\0';
+	if (site->name ? strcmp(&line[2], site->name) : !!line[2])
+		goto unusable;
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] != '\n')
+			goto unusable;
+		line[len - 1] = '\0';
+		new_info = realloc(info, (n + 1) * sizeof(*info));
+		if (!new_info)
+			goto fail;
+		info = new_info;
+		ci = &info[n];
+		memset(ci, 0, sizeof(*ci));
+		off = 0;
+		if (sscanf(line, "%i %i %i %lu %lu %lu %i %i %u %u %u %u %u %u %u %u %n",
+		           &cooperative, &depth, &supported, &red_size, &green_size, &blue_size,
+		           &colourspace, &have_gamut, &ci->red_x, &ci->red_y, &ci->green_x, &ci->green_y,
+		           &ci->blue_x, &ci->blue_y, &ci->white_x, &ci->white_y, &off) != 16 || !off || !line[off])
+			goto unusable;
+		ci->cooperative = cooperative;
+		ci->depth       = (libcoopgamma_depth_t)depth;
+		ci->supported   = (libcoopgamma_support_t)supported;
+		ci->red_size    = (size_t)red_size;
+		ci->green_size  = (size_t)green_size;
+		ci->blue_size   = (size_t)blue_size;
+		ci->colourspace = (libcoopgamma_colourspace_t)colourspace;
+		ci->have_gamut  = have_gamut;
+		name = realloc(names, names_size + (size_t)len - (size_t)off);
+		if (!name)
+			goto fail;
+		names = name;
+		strcpy(&names[names_size], &line[off]);
+		names_size += strlen(&line[off]) + 1;
+		n += 1;
+	}
+	if (ferror(f) || !n)
+		goto unusable;
+
+	list = malloc((n + 1) * sizeof(*list) + names_size);
+	if (!list)
+		goto fail;
+	name = (char *)&list[n + 1];
+	memcpy(name, names, names_size);
+	for (i = 0; i < n; i++) {
+		list[i] = name;
+		name = &name[strlen(name) + 1];
+	}
+	list[n] = NULL;
+
+	fclose(f);
+	free(line);
+	free(names);
+	site->crtcs = list;
+	site->crtcs_n = n;
+	site->cached_info = info;
+	return 1;
+
+unusable:
+	fclose(f);
+	free(line);
+	free(names);
+	free(info);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	fclose(f);
+	free(line);
+	free(names);
+	free(info);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Save a site's CRTC:s and CRTC information to the cache
+ * 
+ * Failure is not reported, the cache is only
+ * an optimisation, but it is reported with -v
+ * 
+ * @param  method  The adjustment method, `NULL` for default
+ * @param  site    The site
+ */
+static void
+save_crtc_cache(const char *method, const site_t *site)
+{
+	char *tmp = NULL, *p;
+	FILE *f = NULL;
+	size_t i;
+	const libcoopgamma_crtc_info_t *ci;
+
+	if (strchr(method ? method : "", '\n') || strchr(site->name ? site->name : "", '\n'))
+		return;
+	for (i = 0; i < site->crtcs_n; i++)
+		if (!*site->crtcs[i] || strchr(site->crtcs[i], '\n'))
+			return;
+
+	tmp = malloc(strlen(site->cache_path) + sizeof("~"));
+	if (!tmp)
+		goto fail;
+	stpcpy(stpcpy(tmp, site->cache_path), "~");
+
+	for (p = strchr(&tmp[1], '/'); p; p = strchr(&p[1], '/')) {
+		*p = '\0';
+		if (mkdir(tmp, 0700) && errno != EEXIST)
+			goto fail;
+		*p = '/';
+	}
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto fail;
+	fprintf(f, "M:%s\nS:%s\n", method ? method : "", site->name ? site->name : "");
+	for (i = 0; i < site->crtcs_n; i++) {
+		ci = &crtc_info[site->crtcs_offset + i];
+		fprintf(f, "%i %i %i %zu %zu %zu %i %i %u %u %u %u %u %u %u %u %s\n",
+		        ci->cooperative, (int)ci->depth, (int)ci->supported,
+		        ci->red_size, ci->green_size, ci->blue_size,
+		        (int)ci->colourspace, ci->have_gamut, ci->red_x, ci->red_y, ci->green_x,
+		        ci->green_y, ci->blue_x, ci->blue_y, ci->white_x, ci->white_y, site->crtcs[i]);
+	}
+	if (fclose(f)) {
+		f = NULL;
+		goto fail;
+	}
+	f = NULL;
+	if (rename(tmp, site->cache_path))
+		goto fail;
+	free(tmp);
+	return;
+
+fail:
+	if (verbose)
+		fprintf(stderr, "%s: warning: cannot write CRTC cache: %s\n", argv0, strerror(errno));
+	if (f)
+		fclose(f);
+	if (tmp)
+		unlink(tmp);
+	free(tmp);
+}
+
+
+/**
+ * Check whether two CRTC information structures are equivalent
+ * 
+ * @param   a  One of the structures
+ * @param   b  The other structure
+ * @return     1 if equivalent, 0 otherwise
+ */
+static int
+crtc_info_equal(const libcoopgamma_crtc_info_t *a, const libcoopgamma_crtc_info_t *b)
+{
+	if (a->cooperative != b->cooperative || a->depth != b->depth || a->supported != b->supported ||
+	    a->red_size != b->red_size || a->green_size != b->green_size || a->blue_size != b->blue_size ||
+	    a->colourspace != b->colourspace || a->have_gamut != b->have_gamut)
+		return 0;
+	if (!a->have_gamut)
+		return 1;
+	return a->red_x == b->red_x && a->red_y == b->red_y &&
+	       a->green_x == b->green_x && a->green_y == b->green_y &&
+	       a->blue_x == b->blue_x && a->blue_y == b->blue_y &&
+	       a->white_x == b->white_x && a->white_y == b->white_y;
+}
+
+
+/**
+ * Check whether the information about a site's
+ * CRTC:s, or their monitors, has changed
+ * 
+ * Must not be called while there are
+ * pending synchronisations on the site
+ * 
+ * @param   site  The site
+ * @return        0: Success, the information is unchanged
+ *                1: Success, the information has changed
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ */
+static int
+site_crtc_info_changed(site_t *site)
+{
+	libcoopgamma_crtc_info_t *info;
+	size_t i, n = site->crtcs_n;
+	int r, changed = 0, saved_errno;
+
+	info = alloca(n * sizeof(*info));
+	for (i = 0; i < n; i++) {
+		if (libcoopgamma_crtc_info_initialise(&info[i]) < 0) {
+			saved_errno = errno;
+			while (i--)
+				libcoopgamma_crtc_info_destroy(&info[i]);
+			errno = saved_errno;
+			return -1;
+		}
+	}
+
+	r = get_crtc_info(site, info);
+	saved_errno = errno;
+	for (i = 0; i < n; i++) {
+		if (!r && !crtc_info_equal(&info[i], &crtc_info[site->crtcs_offset + i]))
+			changed = 1;
+		libcoopgamma_crtc_info_destroy(&info[i]);
+	}
+	errno = saved_errno;
+	return r < 0 ? r : changed;
+}
+
+
+/**
+ * Check, if a site's CRTC:s were loaded from
+ * the cache, that the cache is up to date
+ * 
+ * @param   site  The site
+ * @return        0: Success, the CRTC:s are up to date
+ *                1: Success, the CRTC:s have changed
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ */
+static int
+verify_site_crtc_cache(site_t *site)
+{
+	char **fresh;
+	size_t i, n;
+	int r = 0, saved_errno;
+
+	if (!site->from_cache)
+		return 0;
+	site->from_cache = 0;
+
+	if (libcoopgamma_set_nonblocking(&site->cg, 0) < 0)
+		return -1;
+	fresh = libcoopgamma_get_crtcs_sync(&site->cg);
+	if (!fresh) {
+		cg = &site->cg;
+		return -2;
+	}
+	if (libcoopgamma_set_nonblocking(&site->cg, 1) < 0)
+		goto fail;
+
+	for (n = 0; fresh[n]; n++);
+	if (n != site->crtcs_n)
+		r = 1;
+	for (i = 0; i < n && !r; i++)
+		if (strcmp(fresh[i], site->crtcs[i]))
+			r = 1;
+	free(fresh);
+
+	if (!r && (r = site_crtc_info_changed(site)) < 0)
+		return r;
+	if (r)
+		unlink(site->cache_path);
+	return r;
+
+fail:
+	saved_errno = errno;
+	free(fresh);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Check, if the CRTC:s were loaded from the cache,
+ * that the cache is up to date
+ * 
+ * Must not be called while there are pending
+ * synchronisations; it shall be called once the
+ * first gamma ramps have been sent
+ * 
+ * @return  0: Success, the CRTC:s are up to date
+ *          1: Success, the CRTC:s have changed, the cache
+ *             has been discarded and `start` shall return 1
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+int
+verify_crtc_cache(void)
+{
+	size_t i;
+	int r, changed = 0, verified = 0;
+
+	for (i = 0; i < sites_n; i++) {
+		verified |= sites[i].from_cache;
+		if ((r = verify_site_crtc_cache(&sites[i])) < 0)
+			return r;
+		changed |= r;
+	}
+
+	if (!verified)
+		return 0;
+	stage_done("verify CRTC cache");
+	if (changed && verbose)
+		fprintf(stderr, "%s: CRTC cache is out of date, reconfiguring\n", argv0);
+	return changed;
+}
+
+
+/**
+ * Read back the filter table of a filter's CRTC, with
+ * the filters that have the same priority as the filter
+ * 
+ * Must not be called while there are
+ * pending synchronisations on the site
+ * 
+ * @param   site   The filter's site
+ * @param   index  The index of the filter, its asynchronous
+ *                 call context is used for the query
+ * @param   table  Initialised output parameter for the filter table
+ * @return         Zero on success, -1 on error, -2
+ *                 on libcoopgamma error
+ */
+static int
+read_back_filters(site_t *site, size_t index, libcoopgamma_filter_table_t *table)
+{
+	const libcoopgamma_filter_t *filter = &crtc_updates[index].filter;
+	libcoopgamma_filter_query_t query;
+	struct pollfd pollfd;
+	size_t selected;
+	int need_flush = 0;
+
+	query.high_priority = filter->priority;
+	query.low_priority = filter->priority;
+	query.crtc = filter->crtc;
+	query.coalesce = 0;
+
+	if (libcoopgamma_get_gamma_send(&query, &site->cg, asyncs + index) < 0)
+		goto send_fail;
+
+	pollfd.fd = site->cg.fd;
+	for (;;) {
+		pollfd.events = need_flush ? POLLOUT : POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
+		pollfd.revents = 0;
+		if (poll(&pollfd, (nfds_t)1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (need_flush) {
+			need_flush = 0;
+			if (libcoopgamma_flush(&site->cg) < 0)
+				goto send_fail;
+			continue;
+		}
+		if (!libcoopgamma_synchronise(&site->cg, asyncs + index, 1, &selected))
+			break;
+		switch (errno) {
+		case 0:
+		case EINTR:
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			break;
+		default:
+			return -1;
+		}
+		continue;
+
+	send_fail:
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			METRICS_INC(flush_retries);
+			need_flush = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (libcoopgamma_get_gamma_recv(table, &site->cg, asyncs + index) < 0) {
+		cg = &site->cg;
+		return -2;
 	}
+	return 0;
 }
 
 
 /**
- * Initialise the process, specifically
- * reset the signal mask and signal handlers
+ * Check whether a filter table, read back from
+ * the server, contains a filter as it was sent
  * 
- * @return  Zero on success, -1 on error
+ * @param   filter  The filter, as it was sent
+ * @param   table   The filter table for the filter's CRTC,
+ *                  with the same gamma ramp sizes and depth
+ * @return          1 if the filter is applied unchanged, 0 otherwise
  */
 static int
-initialise_proc(void)
+filter_applied(filter_update_t *filter, const libcoopgamma_filter_table_t *table)
 {
-	sigset_t sigmask;
-	int sig;
-
-	for (sig = 1; sig < _NSIG; sig++)
-		if (signal(sig, SIG_DFL) == SIG_ERR)
-			if (sig == SIGCHLD)
-				return -1;
+	size_t i;
 
-	if (sigemptyset(&sigmask) < 0)
-		return -1;
-	if (sigprocmask(SIG_SETMASK, &sigmask, NULL) < 0)
-		return -1;
+	if (!filter->hashed) {
+		filter->hash = hash_ramps(&filter->filter, &filter->filter.ramps.u8);
+		filter->hashed = 1;
+	}
 
+	for (i = 0; i < table->filter_count; i++)
+		if (table->filters[i].priority == filter->filter.priority && !strcmp(table->filters[i].class, filter->filter.class))
+			return hash_ramps(&filter->filter, &table->filters[i].ramps.u8) == filter->hash;
 	return 0;
 }
 
 
 /**
- * Print, to stdout, a list of all
- * recognised adjustment methods
+ * Check that the filters on one CRTC are still applied,
+ * by reading back the CRTC's filter table and comparing
+ * the hashes of the gamma ramps, and resend the filters
+ * that have been removed or changed by another party
  * 
- * @return  Zero on success, -1 on error
+ * Each call checks the next CRTC, so that only one
+ * filter table is transferred per call
+ * 
+ * If the CRTC's gamma ramp sizes or depth have changed,
+ * the CRTC cache is discarded and `crtcs_changed` is
+ * set, so that the filters are reconfigured and resent
+ * 
+ * Must not be called while there are pending synchronisations
+ * 
+ * @return  0: Success
+ *          1: Success, the CRTC configuration has changed
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
  */
-static int
-list_methods(void)
+int
+verify_filters(void)
 {
-	char **list;
-	size_t i;
+	static size_t next_crtc = 0;
+	libcoopgamma_filter_table_t table;
+	const libcoopgamma_crtc_info_t *info;
+	filter_update_t *filter;
+	site_t *site = NULL;
+	size_t i, n, crtc = 0, first;
+	int r;
+
+	for (n = 0; n < crtcs_n; n++) {
+		crtc = next_crtc++ % crtcs_n;
+		for (i = 0; i < sites_n; i++)
+			if (crtc - sites[i].crtcs_offset < sites[i].crtcs_n)
+				break;
+		site = &sites[i];
+		if (crtc_info[crtc].supported && !site->disconnected)
+			break;
+	}
+	if (n == crtcs_n)
+		return 0;
+	info = &crtc_info[crtc];
+	first = site->filters_offset + (crtc - site->crtcs_offset);
 
-	list = libcoopgamma_get_methods();
-	if (!list)
-		return -1;
-	for (i = 0; list[i]; i++)
-		printf("%s\n", list[i]);
-	free(list);
-	if (fflush(stdout) < 0)
+	METRICS_INC(verifications);
+
+	/* libcoopgamma allocates the filter table, which is
+	 * the only memory allocated in the steady state */
+	alloc_check_stop();
+	if (libcoopgamma_filter_table_initialise(&table) < 0)
 		return -1;
+	r = read_back_filters(site, first, &table);
+	if (r < 0) {
+		libcoopgamma_filter_table_destroy(&table);
+		alloc_check_start();
+		if (r == -1 && is_disconnect(errno))
+			return reconnect_site(site);
+		return r;
+	}
 
-	return 0;
+	if (table.depth != crtc_updates[first].filter.depth || table.red_size != info->red_size ||
+	    table.green_size != info->green_size || table.blue_size != info->blue_size) {
+		libcoopgamma_filter_table_destroy(&table);
+		alloc_check_start();
+		if (site->cache_path)
+			unlink(site->cache_path);
+		crtcs_changed = 1;
+		if (verbose)
+			fprintf(stderr, "%s: CRTC configuration has changed, reconfiguring\n", argv0);
+		return 1;
+	}
+
+	for (i = first, r = 1; i < site->filters_offset + site->filters_n; i += site->crtcs_n) {
+		filter = &crtc_updates[i];
+		if (filter->failed || filter_applied(filter, &table))
+			continue;
+		METRICS_INC(drift_repairs);
+		if (verbose)
+			fprintf(stderr, "%s: filter on CRTC %s has been removed or changed, resending\n",
+			        argv0, filter->filter.crtc);
+		if ((r = update_filter(i, 0)) < 0)
+			break;
+	}
+	libcoopgamma_filter_table_destroy(&table);
+	alloc_check_start();
+	if (r < 0)
+		return r;
+
+	while (r != 1)
+		if ((r = synchronise(-1)) < 0)
+			return r;
+	return crtcs_changed;
 }
 
 
 /**
- * Print, to stdout, a list of all CRTC:s
- * 
- * A connection to the coopgamma server
- * must have been made
- * 
- * @return  Zero on success, -1 on error, -2
- *          on libcoopgamma error
+ * Release `crtcs`, `crtc_info`, `asyncs`, and `crtc_updates`
  */
-static int
-list_crtcs(void)
+static void
+release_crtcs(void)
 {
-	char **list;
 	size_t i;
-
-	list = libcoopgamma_get_crtcs_sync(&cg);
-	if (!list)
-		return -2;
-	for (i = 0; list[i]; i++)
-		printf("%s\n", list[i]);
-	free(list);
-	if (fflush(stdout) < 0)
-		return -1;
-
-	return 0;
+	if (crtc_info) {
+		for (i = 0; i < crtcs_n; i++)
+			libcoopgamma_crtc_info_destroy(crtc_info + i);
+		free(crtc_info);
+		crtc_info = NULL;
+	}
+	if (asyncs) {
+		for (i = 0; i < filters_n; i++)
+			libcoopgamma_async_context_destroy(asyncs + i);
+		free(asyncs);
+		asyncs = NULL;
+	}
+	if (crtc_updates) {
+		for (i = 0; i < filters_n; i++) {
+			if (!crtc_updates[i].master)
+				memset(&crtc_updates[i].filter.ramps.u8, 0, sizeof(crtc_updates[i].filter.ramps.u8));
+			crtc_updates[i].filter.crtc = NULL;
+			crtc_updates[i].filter.class = NULL;
+			libcoopgamma_filter_destroy(&crtc_updates[i].filter);
+			libcoopgamma_error_destroy(&crtc_updates[i].error);
+			free(crtc_updates[i].slaves);
+		}
+		free(crtc_updates);
+		crtc_updates = NULL;
+	}
+	free(crtcs);
+	crtcs = NULL;
+	crtcs_n = 0;
+	filters_n = 0;
+	pending_recvs = 0;
 }
 
 
 /**
- * Fill the list of CRTC information
+ * Release the CRTC:s and CRTC information
+ * of each site, and, unless `disconnect`
+ * is zero, disconnect from the sites
  * 
- * @return  Zero on success, -1 on error, -2
- *          on libcoopgamma error
+ * @param  disconnect  Whether to also disconnect
  */
-static int
-get_crtc_info(void)
+static void
+release_sites(int disconnect)
 {
-	size_t i, unsynced = 0, selected;
-	char *synced;
-	int need_flush = 0;
-	struct pollfd pollfd;
-
-	synced = alloca(crtcs_n * sizeof(*synced));
-	memset(synced, 0, crtcs_n * sizeof(*synced));
-
-	i = 0;
-	pollfd.fd = cg.fd;
-	pollfd.events = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
-
-	while (unsynced > 0 || i < crtcs_n) {
-	wait:
-		if (i < crtcs_n)
-			pollfd.events |= POLLOUT;
-		else
-			pollfd.events &= ~POLLOUT;
-      
-		pollfd.revents = 0;
-		if (poll(&pollfd, (nfds_t)1, -1) < 0)
-			goto fail;
-      
-		if (pollfd.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL)) {
-			if (need_flush && (libcoopgamma_flush(&cg) < 0))
-				goto send_fail;
-			need_flush = 0;
-			for (; i < crtcs_n; i++)
-				if (unsynced++, libcoopgamma_get_gamma_info_send(crtcs[i], &cg, asyncs + i) < 0)
-					goto send_fail;
-			goto send_done;
-		send_fail:
-			switch (errno) {
-			case EINTR:
-			case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-			case EWOULDBLOCK:
-#endif
-				i++;
-				need_flush = 1;
-				break;
-			default:
-				goto fail;
-			}
-		}
-	send_done:
-
-		if (!unsynced && i == crtcs_n)
-			break;
-      
-		if (pollfd.revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI)) {
-			while (unsynced > 0) {
-				switch (libcoopgamma_synchronise(&cg, asyncs, i, &selected)) {
-				case 0:
-					if (synced[selected]) {
-						libcoopgamma_skip_message(&cg);
-						break;
-					}
-					synced[selected] = 1;
-					unsynced -= 1;
-					if (libcoopgamma_get_gamma_info_recv(crtc_info + selected, &cg, asyncs + selected) < 0)
-						goto cg_fail;
-					break;
-				case -1:
-					switch (errno)
-						{
-						case 0:
-							break;
-						case EINTR:
-						case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-						case EWOULDBLOCK:
-#endif
-							goto wait;
-						default:
-							goto fail;
-						}
-					break;
-				}
-			}
+	size_t i;
+	if (!sites)
+		return;
+	for (i = 0; i < sites_n; i++) {
+		if (sites[i].dealloc_crtcs)
+			free(sites[i].crtcs);
+		sites[i].crtcs = NULL;
+		sites[i].crtcs_n = 0;
+		sites[i].dealloc_crtcs = 0;
+		sites[i].from_cache = 0;
+		free(sites[i].cached_info);
+		sites[i].cached_info = NULL;
+		if (disconnect) {
+			free(sites[i].cache_path);
+			if (sites[i].stage >= 1)
+				libcoopgamma_context_destroy(&sites[i].cg, sites[i].stage >= 2);
 		}
 	}
-
-	return 0;
-fail:
-	return -1;
-cg_fail:
-	return -2;
 }
 
 
@@ -509,6 +2144,9 @@ cg_fail:
  * 
  * -S SITE
  *     Select site (display server instance).
+ *     
+ *     This option can be used multiple times to
+ *     drive multiple sites from the same process.
  * 
  * -c CRTC
  *     Select CRT controller. If CRTC is "?", CRTC:s
@@ -516,6 +2154,7 @@ cg_fail:
  *     
  *     This option can be used multiple times. If it
  *     is not used at all, all CRTC:s will be selected.
+ *     The CRTC:s are selected on every site.
  * 
  * -p PRIORITY
  *     Select the priority for the filter, this should
@@ -530,6 +2169,14 @@ cg_fail:
  *     if RULE is "??" the default class is printed
  *     to stdout.
  * 
+ * -C
+ *     Cache the CRTC:s and their information, and use
+ *     the cache to apply the first gamma ramps before
+ *     querying the server. Not used if -c is used.
+ * 
+ * -v
+ *     Print statistics to stderr.
+ * 
  * @param   argc  The number of command line arguments
  * @param   argv  The command line arguments
  * @return        0 on success, 1 on error
@@ -537,32 +2184,38 @@ cg_fail:
 int
 main(int argc, char *argv[])
 {
-	int stage = 0;
-	int dealloc_crtcs = 0;
 	int rc = 0;
-	char *method = NULL;
-	char *site = NULL;
-	size_t crtc_i = 0;
+	char **site_names;
+	char **crtc_args;
+	size_t crtc_i = 0, crtc_args_n;
 	int64_t priority = default_priority;
 	char *prio = NULL;
 	char *rule = NULL;
+	char *recording_path = NULL;
 	char *class = default_class;
 	char **classes = NULL;
 	size_t classes_n = 0;
 	int explicit_crtcs = 0;
 	int have_crtc_q = 0;
-	size_t i, filter_i;
-	const char *side, *crtc;
+	int use_cache = 0;
+	size_t i, j, filter_i;
+	const char *side;
 	size_t len, n;
+	uint32_t version = RECORDING_VERSION;
 	char *args, *arg, *end, *p, opt[3];
 	int at_end;
+	site_t *site;
 
 	argv0 = *argv++, argc--;
 
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	last_stage_time = start_time;
+
 	if (initialise_proc() < 0)
 		goto fail;
 
-	crtcs = alloca((size_t)argc * sizeof(*crtcs));
+	crtc_args = alloca(((size_t)argc + 1) * sizeof(*crtc_args));
+	site_names = alloca(((size_t)argc + 1) * sizeof(*site_names));
 
 	for (; *argv; argv++, argc--) {
 		args = *argv;
@@ -585,12 +2238,13 @@ main(int argc, char *argv[])
 				if (method || !(method = arg))
 					usage();
 			} else if (!strcmp(opt, "-S")) {
-				if (site || !(site = arg))
+				if (!arg)
 					usage();
+				site_names[sites_n++] = arg;
 			} else if (!strcmp(opt, "-c")) {
 				if (!arg)
 					usage();
-				crtcs[crtc_i++] = arg;
+				crtc_args[crtc_i++] = arg;
 				explicit_crtcs = 1;
 				if (!have_crtc_q && !strcmp(arg, "?"))
 					have_crtc_q = 1;
@@ -600,6 +2254,15 @@ main(int argc, char *argv[])
 			} else if (!strcmp(opt, "-R")) {
 				if (rule || !(rule = arg))
 					usage();
+			} else if (!strcmp(opt, "-w")) {
+				if (recording_path || !(recording_path = arg))
+					usage();
+			} else if (!strcmp(opt, "-C")) {
+				use_cache = 1;
+				goto next_opt;
+			} else if (!strcmp(opt, "-v")) {
+				verbose = 1;
+				goto next_opt;
 			} else {
 				switch (handle_opt(opt, arg)) {
 				case 0:
@@ -617,8 +2280,10 @@ main(int argc, char *argv[])
 		}
 	}
 
-	crtcs_n = crtc_i;
-	crtcs[crtc_i] = NULL;
+	crtc_args_n = crtc_i;
+	crtc_args[crtc_i] = NULL;
+	if (!sites_n)
+		site_names[sites_n++] = NULL;
 	if (!have_crtc_q && nulstrcmp(method, "?") &&
 	    nulstrcmp(rule, "?") && nulstrcmp(rule, "??") &&
 	    (default_priority == NO_DEFAULT_PRIORITY || nulstrcmp(prio, "?")))
@@ -665,39 +2330,41 @@ main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (libcoopgamma_context_initialise(&cg) < 0)
+	sites = calloc(sites_n, sizeof(*sites));
+	if (!sites)
 		goto fail;
-	stage++;
-	if (libcoopgamma_connect(method, site, &cg) < 0) {
-		fprintf(stderr, "%s: server failed to initialise\n", argv0);
-		goto custom_fail;
-	}
-	stage++;
-
-	if (have_crtc_q) {
-		switch (list_crtcs()) {
-		case 0:
-			goto done;
-		case -1:
+	cg = &sites->cg;
+	for (i = 0; i < sites_n; i++) {
+		site = &sites[i];
+		site->name = site_names[i];
+		if (libcoopgamma_context_initialise(&site->cg) < 0)
 			goto fail;
-		default:
-			goto cg_fail;
+		site->stage++;
+		if (libcoopgamma_connect(method, site_names[i], &site->cg) < 0) {
+			if (site->name)
+				fprintf(stderr, "%s: server failed to initialise for site %s\n", argv0, site->name);
+			else
+				fprintf(stderr, "%s: server failed to initialise\n", argv0);
+			goto custom_fail;
 		}
+		site->stage++;
 	}
+	stage_done("connect");
 
-	if (!crtcs_n) {
-		crtcs = libcoopgamma_get_crtcs_sync(&cg);
-		if (!crtcs)
-			goto cg_fail;
-		dealloc_crtcs = 1;
-		for (; crtcs[crtcs_n]; crtcs_n++);
+	if (have_crtc_q) {
+		for (i = 0; i < sites_n; i++) {
+			switch (list_crtcs(&sites[i])) {
+			case 0:
+				break;
+			case -1:
+				goto fail;
+			default:
+				goto cg_fail;
+			}
+		}
+		goto done;
 	}
 
-	if (!crtcs_n) {
-		fprintf(stderr, "%s: no CRTC:s are available\n", argv0);
-		goto custom_fail;
-	}
-	
 	if (!*class_suffixes) {
 		classes = &class;
 		classes_n = 1;
@@ -711,30 +2378,121 @@ main(int argc, char *argv[])
 			stpcpy(stpcpy(stpcpy(classes[i], class), ":"), class_suffixes[i]);
 		}
 	}
-	filters_n = classes_n * crtcs_n;
+	if (use_cache && !explicit_crtcs)
+		for (i = 0; i < sites_n; i++)
+			sites[i].cache_path = get_crtc_cache_path(method, sites[i].name);
+
+	if (recording_path) {
+		recording = fopen(recording_path, "wb");
+		if (!recording) {
+			fprintf(stderr, "%s: %s: %s\n", argv0, recording_path, strerror(errno));
+			goto custom_fail;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &recording_start);
+		if (fwrite(RECORDING_MAGIC, sizeof(RECORDING_MAGIC), 1, recording) != 1 ||
+		    fwrite(&version, sizeof(version), 1, recording) != 1)
+			recording_failed();
+	}
 
-	crtc_info = alloca(crtcs_n * sizeof(*crtc_info));
-	memset(crtc_info, 0, crtcs_n * sizeof(*crtc_info));
-	for (crtc_i = 0; crtc_i < crtcs_n; crtc_i++)
-		if (libcoopgamma_crtc_info_initialise(crtc_info + crtc_i) < 0)
-			goto cg_fail;
+reconfigure:
+	for (i = 0; i < sites_n; i++) {
+		site = &sites[i];
+		if (explicit_crtcs) {
+			site->crtcs = crtc_args;
+			site->crtcs_n = crtc_args_n;
+		}
+
+		if (!site->crtcs_n && site->cache_path) {
+			switch (load_crtc_cache(method, site)) {
+			case 0:
+				break;
+			case 1:
+				site->dealloc_crtcs = 1;
+				site->from_cache = 1;
+				stage_done("load CRTC cache");
+				break;
+			default:
+				goto fail;
+			}
+		}
+
+		if (!site->crtcs_n) {
+			site->crtcs = libcoopgamma_get_crtcs_sync(&site->cg);
+			if (!site->crtcs) {
+				cg = &site->cg;
+				goto cg_fail;
+			}
+			site->dealloc_crtcs = 1;
+			for (; site->crtcs[site->crtcs_n]; site->crtcs_n++);
+			stage_done("enumerate CRTCs");
+		}
+
+		site->crtcs_offset = crtcs_n;
+		site->filters_offset = filters_n;
+		site->filters_n = classes_n * site->crtcs_n;
+		crtcs_n += site->crtcs_n;
+		filters_n += site->filters_n;
+	}
 
-	if (libcoopgamma_set_nonblocking(&cg, 1) < 0)
+	if (!crtcs_n) {
+		fprintf(stderr, "%s: no CRTC:s are available\n", argv0);
+		goto custom_fail;
+	}
+
+	crtcs = malloc((crtcs_n + 1) * sizeof(*crtcs));
+	crtc_info = calloc(crtcs_n, sizeof(*crtc_info));
+	asyncs = calloc(filters_n, sizeof(*asyncs));
+	crtc_updates = calloc(filters_n, sizeof(*crtc_updates));
+	if (!crtcs || !crtc_info || !asyncs || !crtc_updates)
 		goto fail;
+	for (i = 0; i < sites_n; i++)
+		memcpy(&crtcs[sites[i].crtcs_offset], sites[i].crtcs, sites[i].crtcs_n * sizeof(*crtcs));
+	crtcs[crtcs_n] = NULL;
+
+	for (crtc_i = 0; crtc_i < crtcs_n; crtc_i++)
+		if (libcoopgamma_crtc_info_initialise(crtc_info + crtc_i) < 0)
+			goto fail;
 
-	asyncs = alloca(filters_n * sizeof(*asyncs));
-	memset(asyncs, 0, filters_n * sizeof(*asyncs));
 	for (filter_i = 0; filter_i < filters_n; filter_i++)
 		if (libcoopgamma_async_context_initialise(asyncs + filter_i) < 0)
 			goto fail;
 
-	switch (get_crtc_info()) {
-	case 0:
-		break;
-	case -1:
-		goto fail;
-	case -2:
-		goto cg_fail;
+	for (i = 0; i < sites_n; i++) {
+		site = &sites[i];
+		if (libcoopgamma_set_nonblocking(&site->cg, 1) < 0)
+			goto fail;
+		if (site->from_cache) {
+			memcpy(&crtc_info[site->crtcs_offset], site->cached_info, site->crtcs_n * sizeof(*crtc_info));
+			free(site->cached_info);
+			site->cached_info = NULL;
+			if (!oneshot)
+				continue;
+		}
+		if (oneshot) {
+			switch (apply_oneshot(i, classes, classes_n, priority)) {
+			case 0:
+				break;
+			case -1:
+				goto fail;
+			case -2:
+				goto cg_fail;
+			default:
+				goto custom_fail;
+			}
+			stage_done("send gamma ramps");
+		} else {
+			switch (get_crtc_info(site, &crtc_info[site->crtcs_offset])) {
+			case 0:
+				break;
+			case -1:
+				goto fail;
+			case -2:
+				goto cg_fail;
+			}
+			stage_done("query CRTC information");
+		}
+		if (site->cache_path && !site->from_cache)
+			save_crtc_cache(method, site);
 	}
 
 	for (crtc_i = 0; crtc_i < crtcs_n; crtc_i++) {
@@ -748,45 +2506,43 @@ main(int argc, char *argv[])
 		}
 	}
 
-	crtc_updates = alloca(filters_n * sizeof(*crtc_updates));
-	memset(crtc_updates, 0, filters_n * sizeof(*crtc_updates));
-	for (filter_i = i = 0; i < classes_n; i++) {
-		for (crtc_i = 0; crtc_i < crtcs_n; crtc_i++, filter_i++) {
-			if (libcoopgamma_filter_initialise(&crtc_updates[filter_i].filter) < 0)
-				goto fail;
-			if (libcoopgamma_error_initialise(&crtc_updates[filter_i].error) < 0)
-				goto fail;
-			crtc_updates[filter_i].crtc = crtc_i;
-			crtc_updates[filter_i].synced = 1;
-			crtc_updates[filter_i].failed = 0;
-			crtc_updates[filter_i].master = 1;
-			crtc_updates[filter_i].slaves = NULL;
-			crtc_updates[filter_i].filter.crtc                = crtcs[crtc_i];
-			crtc_updates[filter_i].filter.class               = classes[i];
-			crtc_updates[filter_i].filter.priority            = priority;
-			crtc_updates[filter_i].filter.depth               = crtc_info[crtc_i].depth;
-			crtc_updates[filter_i].filter.ramps.u8.red_size   = crtc_info[crtc_i].red_size;
-			crtc_updates[filter_i].filter.ramps.u8.green_size = crtc_info[crtc_i].green_size;
-			crtc_updates[filter_i].filter.ramps.u8.blue_size  = crtc_info[crtc_i].blue_size;
-			switch (crtc_updates[filter_i].filter.depth) {
-#define X(CONST, MEMBER, MAX, TYPE)\
-			case CONST:\
-				libcoopgamma_ramps_initialise(&crtc_updates[filter_i].filter.ramps.MEMBER);\
-				libclut_start_over(&crtc_updates[filter_i].filter.ramps.MEMBER, MAX, TYPE, 1, 1, 1);\
-				break;
-			LIST_DEPTHS
-#undef X
-			default:
-				fprintf(stderr, "%s: internal error: gamma ramp type is unrecognised: %i\n",
-				        argv0, crtc_updates[filter_i].filter.depth);
-				goto custom_fail;
+	for (filter_i = j = 0; j < sites_n && !oneshot; j++) {
+		site = &sites[j];
+		for (i = 0; i < classes_n; i++) {
+			for (crtc_i = site->crtcs_offset; crtc_i < site->crtcs_offset + site->crtcs_n; crtc_i++, filter_i++) {
+				switch (initialise_filter(filter_i, crtc_i, j, classes[i], priority)) {
+				case 0:
+					break;
+				case -1:
+					goto fail;
+				default:
+					goto custom_fail;
+				}
 			}
 		}
 	}
+	if (!oneshot)
+		stage_done("initialise filters");
 
 	switch (start()) {
 	case 0:
+		for (i = 0; i < sites_n; i++) {
+			if (sites[i].disconnected) {
+				fprintf(stderr, "%s: connection to coopgamma server lost%s%s\n", argv0,
+				        sites[i].name ? " for site " : "", sites[i].name ? sites[i].name : "");
+				goto custom_fail;
+			}
+		}
 		break;
+	case 1:
+		alloc_check_stop();
+		release_crtcs();
+		release_sites(0);
+		crtcs_changed = 0;
+		for (i = 0; i < sites_n; i++)
+			if (libcoopgamma_set_nonblocking(&sites[i].cg, 0) < 0)
+				goto fail;
+		goto reconfigure;
 	case -1:
 		goto fail;
 	case -2:
@@ -795,54 +2551,14 @@ main(int argc, char *argv[])
 		goto custom_fail;
 	}
 
-	for (filter_i = 0; filter_i < filters_n; filter_i++) {
-		if (crtc_updates[filter_i].failed) {
-			side = cg.error.server_side ? "server" : "client";
-			crtc = crtc_updates[filter_i].filter.crtc;
-			if (cg.error.custom) {
-				if (cg.error.number && cg.error.description) {
-					fprintf(stderr, "%s: %s-side error number %" PRIu64 " for CRTC %s: %s\n",
-						argv0, side, cg.error.number, crtc, cg.error.description);
-				} else if (cg.error.number) {
-					fprintf(stderr, "%s: %s-side error number %" PRIu64 " for CRTC %s\n",
-						argv0, side, cg.error.number, crtc);
-				} else if (cg.error.description) {
-					fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
-						argv0, side, crtc, cg.error.description);
-				}
-			} else if (cg.error.description) {
-				fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
-				        argv0, side, crtc, cg.error.description);
-			} else {
-				fprintf(stderr, "%s: %s-side error for CRTC %s: %s\n",
-				        argv0, side, crtc, strerror((int)cg.error.number));
-			}
-		}
-	}
-
 done:
-	if (dealloc_crtcs)
-		free(crtcs);
-	if (crtc_info)
-		for (crtc_i = 0; crtc_i < crtcs_n; crtc_i++)
-			libcoopgamma_crtc_info_destroy(crtc_info + crtc_i);
-	if (asyncs)
-		for (filter_i = 0; filter_i < filters_n; filter_i++)
-			libcoopgamma_async_context_destroy(asyncs + filter_i);
-	if (stage >= 1)
-		libcoopgamma_context_destroy(&cg, stage >= 2);
-	if (crtc_updates) {
-		for (filter_i = 0; filter_i < filters_n; filter_i++) {
-			if (!crtc_updates[filter_i].master) {
-				memset(&crtc_updates[filter_i].filter.ramps.u8, 0,
-				       sizeof(crtc_updates[filter_i].filter.ramps.u8));
-			}
-			crtc_updates[filter_i].filter.crtc = NULL;
-			crtc_updates[filter_i].filter.class = NULL;
-			libcoopgamma_filter_destroy(&crtc_updates[filter_i].filter);
-			libcoopgamma_error_destroy(&crtc_updates[filter_i].error);
-			free(crtc_updates[filter_i].slaves);
-		}
+	metrics_stop();
+	release_crtcs();
+	release_sites(1);
+	free(sites);
+	if (recording && fclose(recording)) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, recording_path, strerror(errno));
+		rc = 1;
 	}
 	return rc;
 
@@ -858,20 +2574,20 @@ fail:
 
 cg_fail:
 	rc = 1;
-	side = cg.error.server_side ? "server" : "client";
-	if (cg.error.custom) {
-		if (cg.error.number && cg.error.description) {
+	side = cg->error.server_side ? "server" : "client";
+	if (cg->error.custom) {
+		if (cg->error.number && cg->error.description) {
 			fprintf(stderr, "%s: %s-side error number %" PRIu64 ": %s\n",
-			        argv0, side, cg.error.number, cg.error.description);
-		} else if (cg.error.number) {
-			fprintf(stderr, "%s: %s-side error number %" PRIu64 "\n", argv0, side, cg.error.number);
-		} else if (cg.error.description) {
-			fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, cg.error.description);
-		}
-	} else if (cg.error.description) {
-		fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, cg.error.description);
+			        argv0, side, cg->error.number, cg->error.description);
+		} else if (cg->error.number) {
+			fprintf(stderr, "%s: %s-side error number %" PRIu64 "\n", argv0, side, cg->error.number);
+		} else if (cg->error.description) {
+			fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, cg->error.description);
+		}
+	} else if (cg->error.description) {
+		fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, cg->error.description);
 	} else {
-		fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, strerror((int)cg.error.number));
+		fprintf(stderr, "%s: %s-side error: %s\n", argv0, side, strerror((int)cg->error.number));
 	}
 	goto done;
 }
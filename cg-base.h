@@ -2,6 +2,7 @@
 #include <libcoopgamma.h>
 
 #include <inttypes.h>
+#include <time.h>
 
 
 
@@ -56,6 +57,18 @@ typedef struct filter_update
 	 */
 	size_t crtc;
 
+	/**
+	 * The index of the site
+	 */
+	size_t site;
+
+	/**
+	 * Filters are only grouped, to share gamma ramps,
+	 * with filters with the same value; this is 0
+	 * unless set by the program before `make_slaves`
+	 */
+	size_t group;
+
 	/**
 	 * Has the update been synchronised?
 	 */
@@ -63,14 +76,46 @@ typedef struct filter_update
 
 	/**
 	 * Did the update fail?
+	 * 
+	 * A failed update is skipped by `update_filter`
+	 * until `.retry_at`, and then retried
 	 */
 	int failed;
 
 	/**
-	 * Error description if `.failed` is true
+	 * Error description of the last failure
 	 */
 	libcoopgamma_error_t error;
 
+	/**
+	 * The number of times the update has failed
+	 */
+	uint64_t failures;
+
+	/**
+	 * The number of times the update has
+	 * failed since it last succeeded
+	 */
+	unsigned int consecutive_failures;
+
+	/**
+	 * If `.failed` is true, the time, on
+	 * `CLOCK_MONOTONIC`, the update may be retried
+	 */
+	struct timespec retry_at;
+
+	/**
+	 * The hash of the gamma ramps last sent,
+	 * only valid if `.hashed` is true
+	 */
+	uint64_t hash;
+
+	/**
+	 * Whether `.hash` has been calculated
+	 * since the filter was last sent
+	 */
+	int hashed;
+
 	/**
 	 * If zero, the ramps in `.filter` shall
 	 * neither be modified nor freed
@@ -90,6 +135,106 @@ typedef struct filter_update
 } filter_update_t;
 
 
+/**
+ * A site (display server instance) and
+ * the connection to its coopgamma server
+ */
+typedef struct site
+{
+	/**
+	 * The libcoopgamma context
+	 */
+	libcoopgamma_context_t cg;
+
+	/**
+	 * The name of the site, `NULL` for the default site
+	 */
+	const char *name;
+
+	/**
+	 * The names of the site's selected CRTC:s
+	 */
+	char **crtcs;
+
+	/**
+	 * The number of selected CRTC:s on the site
+	 */
+	size_t crtcs_n;
+
+	/**
+	 * The index of the site's first CRTC in
+	 * `crtcs` and `crtc_info`
+	 */
+	size_t crtcs_offset;
+
+	/**
+	 * The index of the site's first filter in
+	 * `crtc_updates`, the site's filters are
+	 * stored contiguously
+	 */
+	size_t filters_offset;
+
+	/**
+	 * The number of filters on the site
+	 */
+	size_t filters_n;
+
+	/**
+	 * Whether `.crtcs` shall be freed
+	 */
+	int dealloc_crtcs;
+
+	/**
+	 * Whether message must be flushed
+	 */
+	int flush_pending;
+
+	/**
+	 * How far the initialisation of `.cg` has come:
+	 * 0 if not initialised, 1 if initialised, 2 if connected
+	 */
+	int stage;
+
+	/**
+	 * Whether the connection to the coopgamma
+	 * server has been lost and not reestablished
+	 */
+	int disconnected;
+
+	/**
+	 * The number of failed attempts to reconnect
+	 * since the connection was lost
+	 */
+	unsigned int reconnect_attempts;
+
+	/**
+	 * If `.disconnected` is true, the time, on
+	 * `CLOCK_MONOTONIC`, of the next attempt to reconnect
+	 */
+	struct timespec reconnect_at;
+
+	/**
+	 * Whether `.crtcs` and the site's CRTC information
+	 * were loaded from the cache and have not yet
+	 * been verified against the server
+	 */
+	int from_cache;
+
+	/**
+	 * CRTC information loaded from the cache,
+	 * `NULL` once moved into `crtc_info`
+	 */
+	libcoopgamma_crtc_info_t *cached_info;
+
+	/**
+	 * The pathname of the CRTC information
+	 * cache file, `NULL` if not used
+	 */
+	char *cache_path;
+
+} site_t;
+
+
 
 /**
  * The process's name
@@ -97,12 +242,23 @@ typedef struct filter_update
 extern const char *argv0;
 
 /**
- * The libcoopgamma context
+ * The selected sites
+ */
+extern site_t *sites;
+
+/**
+ * The number of selected sites
+ */
+extern size_t sites_n;
+
+/**
+ * The libcoopgamma context of the site that
+ * was last used for a failing operation
  */
-extern libcoopgamma_context_t cg;
+extern libcoopgamma_context_t *cg;
 
 /**
- * The names of the selected CRTC:s
+ * The names of the selected CRTC:s, of all sites
  */
 extern char **crtcs;
 
@@ -118,7 +274,7 @@ extern filter_update_t *crtc_updates;
 extern libcoopgamma_crtc_info_t *crtc_info;
 
 /**
- * The number of selected CRTC:s
+ * The number of selected CRTC:s, of all sites
  */
 extern size_t crtcs_n;
 
@@ -127,6 +283,28 @@ extern size_t crtcs_n;
  */
 extern size_t filters_n;
 
+/**
+ * Whether the -v flag (print statistics
+ * to stderr) has been specified
+ */
+extern int verbose;
+
+/**
+ * Set if a site's CRTC:s have changed when
+ * it was reconnected, `start` shall return 1
+ */
+extern int crtcs_changed;
+
+/**
+ * Set by the program, in `handle_args`, if the
+ * filters shall only be applied once: each CRTC's
+ * filters are then filled with `fill_oneshot` and
+ * sent as soon as its information has arrived,
+ * `make_slaves` is not used, and `start` is called
+ * with the replies still pending
+ */
+extern int oneshot;
+
 
 
 /**
@@ -156,34 +334,119 @@ int make_slaves(void);
 /**
  * Update a filter and synchronise calls
  * 
+ * If the connection to the server is lost, it is
+ * reestablished and all filters on the site are resent;
+ * filters that have thereby already been resent, and
+ * filters on a site that is waiting to be reconnected,
+ * are skipped
+ * 
+ * If the filter has failed, it is skipped until
+ * it may be retried
+ * 
  * @param   index    The index of the CRTC
  * @param   timeout  The number of milliseconds a call to `poll` may block,
  *                   -1 if it may block forever
  * @return           1: Success, no pending synchronisations
  *                   0: Success, with still pending synchronisations
  *                   -1: Error, `errno` set
- *                   -2: Error, `cg.error` set
+ *                   -2: Error, `cg->error` set
  * 
  * @throws  EINTR   Call to `poll` was interrupted by a signal
  * @throws  EAGAIN  Call to `poll` timed out
  */
 int update_filter(size_t index, int timeout);
 
+/**
+ * Get the time until the next scheduled retry of a
+ * failed filter update, or attempt to reconnect
+ * to a site whose connection was lost
+ * 
+ * @return  The number of milliseconds until the retry,
+ *          0 if it is due, -1 if none is scheduled
+ */
+int retry_delay(void);
+
+/**
+ * Retry the failed filter updates, and make the
+ * attempts to reconnect to sites whose connection
+ * was lost, that are due, and wait until the
+ * resent filters have been replied
+ * 
+ * Must not be called while there are pending synchronisations
+ * 
+ * @return  0: Success
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+int retry_filters(void);
+
 /**
  * Synchronised calls
  * 
+ * If the connection to a server is lost, it is
+ * reestablished and all filters on the site are resent
+ * 
  * @param   timeout  The number of milliseconds a call to `poll` may block,
  *                   -1 if it may block forever
  * @return           1: Success, no pending synchronisations
  *                   0: Success, with still pending synchronisations
  *                   -1: Error, `errno` set
- *                   -2: Error, `cg.error` set
+ *                   -2: Error, `cg->error` set
  * 
  * @throws  EINTR   Call to `poll` was interrupted by a signal
  * @throws  EAGAIN  Call to `poll` timed out
  */
 int synchronise(int timeout);
 
+/**
+ * Check that the filters on one CRTC are still applied,
+ * by reading back the CRTC's filter table and comparing
+ * the hashes of the gamma ramps, and resend the filters
+ * that have been removed or changed by another party
+ * 
+ * Each call checks the next CRTC, so that only one
+ * filter table is transferred per call
+ * 
+ * If the CRTC's gamma ramp sizes or depth have changed,
+ * the CRTC cache is discarded and `crtcs_changed` is
+ * set, so that the filters are reconfigured and resent
+ * 
+ * Must not be called while there are pending synchronisations
+ * 
+ * @return  0: Success
+ *          1: Success, the CRTC configuration has changed
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+int verify_filters(void);
+
+
+/**
+ * Report, if -v has been specified, that a
+ * startup stage has finished and how long it took
+ * 
+ * @param  stage  The name of the stage
+ */
+void stage_done(const char *stage);
+
+/**
+ * Check, if the CRTC:s were loaded from the cache,
+ * that the cache is up to date
+ * 
+ * Must not be called while there are pending
+ * synchronisations; it shall be called each time
+ * gamma ramps have been applied, it only queries
+ * the server the first time after the CRTC:s have
+ * been loaded from the cache
+ * 
+ * @return  0: Success, the CRTC:s are up to date
+ *          1: Success, the CRTC:s have changed, the cache
+ *             has been discarded and `start` shall return 1
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+int verify_crtc_cache(void);
+
 
 /**
  * Print usage information and exit
@@ -199,7 +462,8 @@ extern void usage(void);
  * @param   opt  The option, it is a NUL-terminate two-character
  *               string starting with either '-' or '+', if the
  *               argument is not recognised, call `usage`. This
- *               string will not be "-M", "-S", "-c", "-p", or "-R".
+ *               string will not be "-M", "-S", "-c", "-p", "-R",
+ *               "-w", "-C", or "-v".
  * @param   arg  The argument associated with `opt`,
  *               `NULL` there is no next argument, if this
  *               parameter is `NULL` but needed, call `usage`
@@ -226,12 +490,24 @@ __attribute__((__nonnull__(2)))
 #endif
 extern int handle_args(int argc, char *argv[], char *prio);
 
+/**
+ * Fill a filter's gamma ramps, and set its lifespan,
+ * when `oneshot` is set; called once the filter has
+ * been initialised, before it is sent
+ * 
+ * @param  index  The index of the filter
+ */
+extern void fill_oneshot(size_t index);
+
 /**
  * The main function for the program-specific code
  * 
  * @return  0: Success
+ *          1: The CRTC configuration has changed (see
+ *             `verify_crtc_cache`), `start` will be
+ *             called again once it has been reloaded
  *          -1: Error, `errno` set
- *          -2: Error, `cg.error` set
+ *          -2: Error, `cg->error` set
  *          -3: Error, message already printed
  */
 extern int start(void);
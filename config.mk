@@ -4,3 +4,15 @@ MANPREFIX = $(PREFIX)/share/man
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE
 CFLAGS   = -std=c99 -Wall -O2
 LDFLAGS  = -lcoopgamma -lred -lm -s
+
+# Used to build mkblackbody, which is run during
+# the build, change these when cross-compiling
+HOSTCC        = $(CC)
+HOST_CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE
+HOST_CFLAGS   = -std=c99 -Wall -O2
+HOST_LDFLAGS  = -lred -lm
+
+# Add -DALLOC_CHECK to CPPFLAGS to count memory allocations
+# (requires glibc) and make the simulation selected with -T
+# fail if memory is allocated after initialisation; this is
+# a manual check, run radharc with -T to perform it
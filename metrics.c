@@ -0,0 +1,697 @@
+/* See LICENSE file for copyright and license details. */
+#include "metrics.h"
+#include "cg-base.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <alloca.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/**
+ * The number of milliseconds a metrics client
+ * may take to read the metrics before it is dropped
+ */
+#define CLIENT_TIMEOUT_MS 1000
+
+
+
+/**
+ * Whether metrics are being collected
+ */
+int metrics_enabled = 0;
+
+/**
+ * The collected metrics, only valid
+ * if `metrics_enabled` is true
+ */
+struct metrics metrics;
+
+
+/**
+ * The socket metrics are served on, -1 if none
+ */
+static int metrics_fd = -1;
+
+/**
+ * The pathname of `metrics_fd`
+ */
+static char *metrics_path = NULL;
+
+/**
+ * For each filter, the time, as returned by
+ * `metrics_now`, the last update was sent
+ */
+static double *sent_at = NULL;
+
+/**
+ * Buffer the metrics are rendered into before they are
+ * sent to a client, allocated by `metrics_start` so
+ * that serving a client does not allocate memory
+ */
+static char *text = NULL;
+
+/**
+ * The size of `text`
+ */
+static size_t text_size = 0;
+
+/**
+ * Unbuffered stream that writes to `text`
+ */
+static FILE *text_stream = NULL;
+
+/**
+ * The socket of the metrics client being served, in
+ * nonblocking mode, -1 if none; further clients are
+ * not accepted until it has been served, as the
+ * metrics rendered for it in `text` are not yet sent
+ */
+static int client_fd = -1;
+
+/**
+ * The number of bytes in `text` for `client_fd`
+ */
+static size_t client_size;
+
+/**
+ * The number of bytes in `text` sent to `client_fd`
+ */
+static size_t client_sent;
+
+/**
+ * The time, as returned by `metrics_now`, `client_fd`
+ * is dropped if it has not read the metrics
+ */
+static double client_deadline;
+
+
+
+/**
+ * Get the exclusive upper bound of a histogram bucket
+ * 
+ * @param   bucket  The index of the bucket
+ * @return          The upper bound, in microseconds
+ */
+static uint64_t
+bucket_bound(size_t bucket)
+{
+	size_t magnitude = bucket / HISTOGRAM_SUB_BUCKETS;
+	size_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	if (!magnitude)
+		return (uint64_t)sub + 1;
+	return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (magnitude - 1);
+}
+
+
+/**
+ * Get the histogram bucket a duration belongs to
+ * 
+ * @param   us  The duration, in microseconds
+ * @return      The index of the bucket
+ */
+static size_t
+bucket_index(uint64_t us)
+{
+	size_t magnitude = 0;
+	uint64_t v;
+	if (us < HISTOGRAM_SUB_BUCKETS)
+		return (size_t)us;
+	for (v = us / HISTOGRAM_SUB_BUCKETS; v > 1; v >>= 1)
+		magnitude++;
+	magnitude += 1;
+	if (magnitude >= HISTOGRAM_BUCKETS / HISTOGRAM_SUB_BUCKETS)
+		return HISTOGRAM_BUCKETS - 1;
+	return magnitude * HISTOGRAM_SUB_BUCKETS + (size_t)((us >> (magnitude - 1)) % HISTOGRAM_SUB_BUCKETS);
+}
+
+
+/**
+ * Get the current time, for timing metrics
+ * 
+ * @return  The current monotonic time, in seconds
+ */
+double
+metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+
+/**
+ * Record a duration in a histogram
+ * 
+ * @param  histogram  The histogram
+ * @param  seconds    The duration, in seconds
+ */
+void
+metrics_record(struct histogram *histogram, double seconds)
+{
+	if (seconds < 0)
+		seconds = 0;
+	histogram->buckets[bucket_index((uint64_t)(seconds * 1000000))] += 1;
+	histogram->count += 1;
+	histogram->sum += seconds;
+}
+
+
+/**
+ * Record that a gamma ramp update has been sent,
+ * use `METRICS_SENT` instead unless metrics are
+ * known to be collected
+ * 
+ * @param  index  The index of the filter
+ */
+void
+metrics_sent(size_t index)
+{
+	sent_at[index] = metrics_now();
+}
+
+
+/**
+ * Record that a gamma ramp update has been replied,
+ * use `METRICS_RECEIVED` instead unless metrics
+ * are known to be collected
+ * 
+ * @param  index  The index of the filter
+ */
+void
+metrics_received(size_t index)
+{
+	metrics_record(&metrics.set_gamma_latency[index], metrics_now() - sent_at[index]);
+}
+
+
+/**
+ * Print a string as a label value
+ * 
+ * @param  f    The output stream
+ * @param  str  The string
+ */
+static void
+print_label(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\\' || *str == '"')
+			fprintf(f, "\\%c", *str);
+		else if (*str == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*str, f);
+	}
+}
+
+
+/**
+ * Print a sample of a histogram in Prometheus text format
+ * 
+ * @param  f       The output stream
+ * @param  name    The name of the sample
+ * @param  filter  The index of the filter the histogram
+ *                 is for, `filters_n` if none
+ * @param  le      The value of the "le" label, `NULL` if none
+ */
+static void
+print_sample_name(FILE *f, const char *name, size_t filter, const char *le)
+{
+	fputs(name, f);
+	if (filter >= filters_n && !le)
+		return;
+	fputc('{', f);
+	if (filter < filters_n) {
+		if (sites[crtc_updates[filter].site].name) {
+			fputs("site=\"", f);
+			print_label(f, sites[crtc_updates[filter].site].name);
+			fputs("\",", f);
+		}
+		fputs("crtc=\"", f);
+		print_label(f, crtc_updates[filter].filter.crtc);
+		fputs("\",class=\"", f);
+		print_label(f, crtc_updates[filter].filter.class);
+		fputc('"', f);
+		if (le)
+			fputc(',', f);
+	}
+	if (le)
+		fprintf(f, "le=\"%s\"", le);
+	fputc('}', f);
+}
+
+
+/**
+ * Print a histogram in Prometheus text format
+ * 
+ * @param  f          The output stream
+ * @param  name       The name of the metric
+ * @param  filter     The index of the filter the histogram
+ *                    is for, `filters_n` if none
+ * @param  histogram  The histogram
+ */
+static void
+print_histogram(FILE *f, const char *name, size_t filter, const struct histogram *histogram)
+{
+	char sample[128], le[32];
+	uint64_t cumulative = 0;
+	size_t i;
+
+	snprintf(sample, sizeof(sample), "%s_bucket", name);
+	for (i = 0; i + 1 < HISTOGRAM_BUCKETS; i++) {
+		cumulative += histogram->buckets[i];
+		snprintf(le, sizeof(le), "%g", (double)bucket_bound(i) / 1000000);
+		print_sample_name(f, sample, filter, le);
+		fprintf(f, " %" PRIu64 "\n", cumulative);
+	}
+	print_sample_name(f, sample, filter, "+Inf");
+	fprintf(f, " %" PRIu64 "\n", histogram->count);
+
+	snprintf(sample, sizeof(sample), "%s_sum", name);
+	print_sample_name(f, sample, filter, NULL);
+	fprintf(f, " %.9f\n", histogram->sum);
+
+	snprintf(sample, sizeof(sample), "%s_count", name);
+	print_sample_name(f, sample, filter, NULL);
+	fprintf(f, " %" PRIu64 "\n", histogram->count);
+}
+
+
+/**
+ * Print all metrics in Prometheus text format
+ * 
+ * @param  f  The output stream
+ */
+static void
+render_metrics(FILE *f)
+{
+	size_t i;
+	struct rusage ru;
+
+#define COUNTER(NAME, MEMBER, HELP)\
+	fprintf(f, "# HELP radharc_" NAME " " HELP "\n"\
+	           "# TYPE radharc_" NAME " counter\n"\
+	           "radharc_" NAME " %" PRIu64 "\n", metrics.MEMBER)
+	COUNTER("wakeups_total", wakeups, "Number of wakeups from poll or a timer");
+	COUNTER("flush_retries_total", flush_retries, "Number of EAGAIN or EINTR when flushing messages");
+	COUNTER("server_failures_total", server_failures, "Number of failed gamma ramp updates reported by the server");
+	COUNTER("verifications_total", verifications, "Number of times the filters on a CRTC were read back to check that they are applied");
+	COUNTER("drift_repairs_total", drift_repairs, "Number of filters resent because another party removed or changed them");
+#undef COUNTER
+
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		fprintf(f, "# HELP radharc_peak_resident_set_bytes Largest resident set size of the process\n"
+		           "# TYPE radharc_peak_resident_set_bytes gauge\n"
+		           "radharc_peak_resident_set_bytes %ld\n", ru.ru_maxrss * 1024L);
+	}
+
+	fputs("# HELP radharc_frame_compute_seconds Time spent computing the gamma ramps of a frame\n"
+	      "# TYPE radharc_frame_compute_seconds histogram\n", f);
+	print_histogram(f, "radharc_frame_compute_seconds", filters_n, &metrics.frame_compute);
+
+	fputs("# HELP radharc_set_gamma_latency_seconds Time from a gamma ramp update is sent until it is replied\n"
+	      "# TYPE radharc_set_gamma_latency_seconds histogram\n", f);
+	for (i = 0; i < filters_n; i++)
+		if (crtc_updates[i].filter.crtc)
+			print_histogram(f, "radharc_set_gamma_latency_seconds", i, &metrics.set_gamma_latency[i]);
+
+	fputs("# HELP radharc_set_gamma_failures_total Number of failed gamma ramp updates for each filter\n"
+	      "# TYPE radharc_set_gamma_failures_total counter\n", f);
+	for (i = 0; i < filters_n; i++) {
+		if (crtc_updates[i].filter.crtc) {
+			print_sample_name(f, "radharc_set_gamma_failures_total", i, NULL);
+			fprintf(f, " %" PRIu64 "\n", crtc_updates[i].failures);
+		}
+	}
+}
+
+
+/**
+ * Allocate `text`, and open `text_stream`
+ * 
+ * @param   size  The size of `text`
+ * @return        Zero on success, -1 on error
+ */
+static int
+open_text(size_t size)
+{
+	char *new;
+
+	if (text_stream) {
+		fclose(text_stream);
+		text_stream = NULL;
+	}
+	new = realloc(text, size);
+	if (!new)
+		return -1;
+	text = new;
+	text_size = size;
+
+	text_stream = fmemopen(text, text_size, "w");
+	if (!text_stream)
+		return -1;
+	if (setvbuf(text_stream, NULL, _IONBF, 0)) {
+		fclose(text_stream);
+		text_stream = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Close the connection to the metrics client
+ * being served, if any
+ */
+static void
+drop_client(void)
+{
+	if (client_fd >= 0) {
+		close(client_fd);
+		client_fd = -1;
+	}
+}
+
+
+/**
+ * Send as much of the metrics as the metrics client
+ * being served accepts without blocking, and close
+ * the connection when all has been sent
+ */
+static void
+send_to_client(void)
+{
+	ssize_t r;
+
+	while (client_sent < client_size) {
+		r = write(client_fd, &text[client_sent], client_size - client_sent);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				drop_client();
+			return;
+		}
+		client_sent += (size_t)r;
+	}
+	drop_client();
+}
+
+
+/**
+ * Render all metrics, in Prometheus text format,
+ * into `text` for a newly connected client, and
+ * start sending them
+ * 
+ * The client is given `CLIENT_TIMEOUT_MS` milliseconds
+ * to read the metrics, and is dropped if it does not
+ * 
+ * @param  fd  The client's socket, in nonblocking mode
+ */
+static void
+serve_metrics(int fd)
+{
+	size_t size;
+
+	client_fd = fd;
+	for (;;) {
+		rewind(text_stream);
+		clearerr(text_stream);
+		render_metrics(text_stream);
+		fflush(text_stream);
+		size = (size_t)ftell(text_stream);
+		if (!ferror(text_stream) && size + 1 < text_size)
+			break;
+		/* Only if a counter has grown beyond the margin
+		 * `metrics_start` allowed for, the metrics are
+		 * otherwise rendered without allocating memory */
+		if (open_text(text_size * 2)) {
+			drop_client();
+			return;
+		}
+	}
+
+	client_size = size;
+	client_sent = 0;
+	client_deadline = metrics_now() + (double)CLIENT_TIMEOUT_MS / 1000;
+	send_to_client();
+}
+
+
+/**
+ * Allocate the metrics for each filter, and
+ * allocate `text` with room for the metrics
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+prepare_filters(void)
+{
+	char *initial = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	/* `text` is reallocated, and the client's
+	 * metrics are for the old filters */
+	drop_client();
+
+	free(metrics.set_gamma_latency);
+	free(sent_at);
+	metrics.set_gamma_latency = calloc(filters_n, sizeof(*metrics.set_gamma_latency));
+	sent_at = calloc(filters_n, sizeof(*sent_at));
+	if (!metrics.set_gamma_latency || !sent_at)
+		return -1;
+
+	/* Make room for twice the size of the metrics at
+	 * start, which leaves room for every number to
+	 * grow to its maximum number of digits */
+	f = open_memstream(&initial, &size);
+	if (!f)
+		return -1;
+	render_metrics(f);
+	if (fclose(f)) {
+		free(initial);
+		return -1;
+	}
+	free(initial);
+	return open_text(2 * size + 4096);
+}
+
+
+/**
+ * Start collecting metrics and serve them
+ * in Prometheus text format on a socket
+ * 
+ * Must not be called until `filters_n`
+ * and `crtc_updates` have been set
+ * 
+ * @param   path  The pathname of the socket to bind
+ * @return        Zero on success, -1 on error
+ */
+int
+metrics_start(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int saved_errno;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	memset(&metrics, 0, sizeof(metrics));
+	metrics_path = strdup(path);
+	if (!metrics_path)
+		goto fail;
+
+	metrics_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (metrics_fd < 0)
+		goto fail;
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(metrics_fd, (const struct sockaddr *)&addr, (socklen_t)sizeof(addr)))
+		goto fail;
+	if (listen(metrics_fd, SOMAXCONN))
+		goto fail;
+	if (prepare_filters())
+		goto fail;
+
+	metrics_enabled = 1;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	metrics_stop();
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Reallocate the metrics for each filter after
+ * the filters have been reconfigured, without
+ * restarting the server or resetting the counters
+ * 
+ * The metrics for each filter are reset
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+metrics_reconfigure(void)
+{
+	int saved_errno;
+	if (!metrics_enabled || !prepare_filters())
+		return 0;
+	saved_errno = errno;
+	metrics_stop();
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Stop serving metrics, unlink the
+ * socket and release resources
+ */
+void
+metrics_stop(void)
+{
+	drop_client();
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		if (metrics_enabled)
+			unlink(metrics_path);
+		metrics_fd = -1;
+	}
+	metrics_enabled = 0;
+	free(metrics.set_gamma_latency);
+	metrics.set_gamma_latency = NULL;
+	free(sent_at);
+	sent_at = NULL;
+	free(metrics_path);
+	metrics_path = NULL;
+	if (text_stream) {
+		fclose(text_stream);
+		text_stream = NULL;
+	}
+	free(text);
+	text = NULL;
+	text_size = 0;
+}
+
+
+/**
+ * Continue serving the metrics client being served,
+ * or drop it if it has timed out, or if there is
+ * none, accept and start serving a pending client
+ * 
+ * @param  listen_revents  The events returned by `poll` for `metrics_fd`
+ * @param  client_revents  The events returned by `poll` for `client_fd`
+ */
+static void
+serve_clients(int listen_revents, int client_revents)
+{
+	int fd;
+
+	if (client_fd >= 0) {
+		if (client_revents & (POLLERR | POLLHUP | POLLNVAL))
+			drop_client();
+		else if (client_revents)
+			send_to_client();
+		else if (metrics_now() >= client_deadline)
+			drop_client();
+	}
+
+	while (client_fd < 0 && listen_revents) {
+		fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		serve_metrics(fd);
+	}
+}
+
+
+/**
+ * Wait until any of a set of file descriptors
+ * has an event, serving metrics requests while
+ * waiting
+ * 
+ * Metrics clients are served without blocking,
+ * so serving them does not delay the caller
+ * 
+ * @param   fds      The file descriptors, and the events to wait for;
+ *                   `.revents` is set in each element on return
+ * @param   n        The number of elements in `fds`
+ * @param   timeout  The number of milliseconds to wait at most,
+ *                   -1 to wait until a file descriptor has an event
+ * @return           1 if a file descriptor had an event,
+ *                   0 on timeout, -1 on error
+ */
+int
+metrics_wait(struct pollfd *fds, size_t n, int timeout)
+{
+	struct pollfd *pollfds;
+	double deadline = 0, now, left;
+	size_t i;
+	int r, poll_timeout;
+
+	pollfds = alloca((n + 2) * sizeof(*pollfds));
+	memcpy(pollfds, fds, n * sizeof(*fds));
+	pollfds[n].events = POLLIN;
+	pollfds[n + 1].events = POLLOUT;
+
+	if (timeout >= 0)
+		deadline = metrics_now() + (double)timeout / 1000;
+
+	for (;;) {
+		/* Further clients wait in the listen queue
+		 * while a client is being served */
+		pollfds[n].fd = client_fd >= 0 ? -1 : metrics_fd;
+		pollfds[n + 1].fd = client_fd;
+		for (i = 0; i < n + 2; i++)
+			pollfds[i].revents = 0;
+
+		poll_timeout = timeout;
+		if (client_fd >= 0) {
+			left = client_deadline - metrics_now();
+			left = left > 0 ? left * 1000 + 1 : 0;
+			if (poll_timeout < 0 || left < (double)poll_timeout)
+				poll_timeout = (int)left;
+		}
+
+		r = poll(pollfds, (nfds_t)(n + 2), poll_timeout);
+		if (r < 0)
+			return -1;
+		METRICS_INC(wakeups);
+		for (i = 0; i < n; i++)
+			fds[i].revents = pollfds[i].revents;
+		serve_clients(pollfds[n].revents, pollfds[n + 1].revents);
+		if (r > !!pollfds[n].revents + !!pollfds[n + 1].revents)
+			return 1;
+		if (!r && poll_timeout == timeout)
+			return 0;
+		if (timeout >= 0) {
+			now = metrics_now();
+			if (now >= deadline)
+				return 0;
+			left = (deadline - now) * 1000;
+			timeout = (int)(left + 0.5);
+		}
+	}
+}
@@ -0,0 +1,210 @@
+/* See LICENSE file for copyright and license details. */
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/**
+ * The number of linear sub-buckets per power of two in a histogram
+ */
+#define HISTOGRAM_SUB_BUCKETS 4
+
+/**
+ * The number of buckets in a histogram, the last bucket
+ * counts all values of at least 2²⁷ microseconds
+ */
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 27)
+
+
+/**
+ * Increase a counter in `metrics` by one, this
+ * is a no-op unless metrics are being collected
+ * 
+ * @param  COUNTER  The name of the counter
+ */
+#define METRICS_INC(COUNTER)\
+	((void)(metrics_enabled ? (metrics.COUNTER += 1) : 0))
+
+/**
+ * Record that a gamma ramp update has been sent,
+ * this is a no-op unless metrics are being collected
+ * 
+ * @param  INDEX  The index of the filter
+ */
+#define METRICS_SENT(INDEX)\
+	((void)(metrics_enabled ? (metrics_sent(INDEX), 0) : 0))
+
+/**
+ * Record that a gamma ramp update has been replied,
+ * this is a no-op unless metrics are being collected
+ * 
+ * @param  INDEX  The index of the filter
+ */
+#define METRICS_RECEIVED(INDEX)\
+	((void)(metrics_enabled ? (metrics_received(INDEX), 0) : 0))
+
+
+
+/**
+ * A histogram over durations with logarithmic
+ * buckets, each split into linear sub-buckets
+ */
+struct histogram
+{
+	/**
+	 * The number of recorded values in each bucket
+	 */
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+
+	/**
+	 * The number of recorded values
+	 */
+	uint64_t count;
+
+	/**
+	 * The sum of all recorded values, in seconds
+	 */
+	double sum;
+};
+
+
+/**
+ * All collected metrics
+ */
+struct metrics
+{
+	/**
+	 * The number of times the process
+	 * woke up from `poll` or a timer
+	 */
+	uint64_t wakeups;
+
+	/**
+	 * The number of times a message could not
+	 * be flushed because of `EAGAIN` or `EINTR`
+	 */
+	uint64_t flush_retries;
+
+	/**
+	 * The number of server-side failures
+	 * caught in `synchronise`
+	 */
+	uint64_t server_failures;
+
+	/**
+	 * The number of times the filters on
+	 * a CRTC were read back to check that
+	 * they are applied
+	 */
+	uint64_t verifications;
+
+	/**
+	 * The number of filters that were resent because
+	 * they had been removed or changed by another party
+	 */
+	uint64_t drift_repairs;
+
+	/**
+	 * The time spent computing the ramps of each frame
+	 */
+	struct histogram frame_compute;
+
+	/**
+	 * For each filter, the time from a gamma
+	 * ramp update was sent until it was replied
+	 */
+	struct histogram *set_gamma_latency;
+};
+
+
+
+/**
+ * Whether metrics are being collected
+ */
+extern int metrics_enabled;
+
+/**
+ * The collected metrics, only valid
+ * if `metrics_enabled` is true
+ */
+extern struct metrics metrics;
+
+
+
+/**
+ * Start collecting metrics and serve them
+ * in Prometheus text format on a socket
+ * 
+ * Must not be called until `filters_n`
+ * and `crtc_updates` have been set
+ * 
+ * @param   path  The pathname of the socket to bind
+ * @return        Zero on success, -1 on error
+ */
+int metrics_start(const char *path);
+
+/**
+ * Reallocate the metrics for each filter after
+ * the filters have been reconfigured, without
+ * restarting the server or resetting the counters
+ * 
+ * The metrics for each filter are reset
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int metrics_reconfigure(void);
+
+/**
+ * Stop serving metrics, unlink the
+ * socket and release resources
+ */
+void metrics_stop(void);
+
+/**
+ * Get the current time, for timing metrics
+ * 
+ * @return  The current monotonic time, in seconds
+ */
+double metrics_now(void);
+
+/**
+ * Record a duration in a histogram
+ * 
+ * @param  histogram  The histogram
+ * @param  seconds    The duration, in seconds
+ */
+void metrics_record(struct histogram *histogram, double seconds);
+
+/**
+ * Record that a gamma ramp update has been sent,
+ * use `METRICS_SENT` instead unless metrics are
+ * known to be collected
+ * 
+ * @param  index  The index of the filter
+ */
+void metrics_sent(size_t index);
+
+/**
+ * Record that a gamma ramp update has been replied,
+ * use `METRICS_RECEIVED` instead unless metrics
+ * are known to be collected
+ * 
+ * @param  index  The index of the filter
+ */
+void metrics_received(size_t index);
+
+/**
+ * Wait until any of a set of file descriptors
+ * has an event, serving metrics requests while
+ * waiting
+ * 
+ * @param   fds      The file descriptors, and the events to wait for;
+ *                   `.revents` is set in each element on return
+ * @param   n        The number of elements in `fds`
+ * @param   timeout  The number of milliseconds to wait at most,
+ *                   -1 to wait until a file descriptor has an event
+ * @return           1 if a file descriptor had an event,
+ *                   0 on timeout, -1 on error
+ */
+int metrics_wait(struct pollfd *fds, size_t n, int timeout);
@@ -0,0 +1,49 @@
+/* See LICENSE file for copyright and license details. */
+#include <libred.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+
+/**
+ * The colour temperature difference, in kelvins,
+ * between adjacent elements in the table
+ */
+#define STEP 10
+
+
+
+/**
+ * Print, to stdout, a C header with a table of the
+ * RGB values of blackbody colour temperatures, as
+ * calculated by libred, for `get_colour` in radharc.c
+ * 
+ * @return  0 on success, 1 on error
+ */
+int
+main(void)
+{
+	long int kelvin;
+	double red, green, blue;
+
+	printf("/* This file is generated by mkblackbody, do not edit. */\n\n");
+	printf("#define BLACKBODY_LOWEST %i\n", LIBRED_LOWEST_TEMPERATURE);
+	printf("#define BLACKBODY_HIGHEST %i\n", LIBRED_HIGHEST_TEMPERATURE);
+	printf("#define BLACKBODY_STEP %i\n\n", STEP);
+	printf("static const double blackbody_table[][3] = {\n");
+	for (kelvin = LIBRED_LOWEST_TEMPERATURE; kelvin <= LIBRED_HIGHEST_TEMPERATURE; kelvin += STEP) {
+		if (libred_get_colour(kelvin, &red, &green, &blue)) {
+			perror("mkblackbody");
+			return 1;
+		}
+		printf("\t{%.17g, %.17g, %.17g},\n", red, green, blue);
+	}
+	printf("};\n");
+
+	if (fflush(stdout) || ferror(stdout)) {
+		perror("mkblackbody");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * USDT probes, for use with tools such as bpftrace and perf,
+ * under the provider name "radharc". The probes are only
+ * compiled in if <sys/sdt.h> is available and NO_USDT is
+ * not defined; otherwise they expand to nothing and their
+ * arguments are not evaluated.
+ * 
+ * Probes:
+ * 
+ *   set_gamma_send(size_t filter, const char *crtc)
+ *       A gamma ramp update is about to be sent
+ * 
+ *   set_gamma_reply(size_t filter, int failed)
+ *       A reply to a gamma ramp update has been received
+ * 
+ *   fill_filter_entry(int depth, size_t stops)
+ *   fill_filter_exit(int depth, size_t stops)
+ *       A filter is about to be, or has been, computed,
+ *       `stops` is the total number of ramp stops
+ * 
+ *   fade_tick(size_t tick, size_t ticks, long int kelvin)
+ *       A frame in the fade is about to be applied
+ * 
+ *   temperature(long int kelvin)
+ *       The colour temperature has been calculated
+ */
+
+#if !defined(NO_USDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_USDT
+# endif
+#endif
+
+#ifdef HAVE_USDT
+# define PROBE1(NAME, A) DTRACE_PROBE1(radharc, NAME, A)
+# define PROBE2(NAME, A, B) DTRACE_PROBE2(radharc, NAME, A, B)
+# define PROBE3(NAME, A, B, C) DTRACE_PROBE3(radharc, NAME, A, B, C)
+#else
+# define PROBE1(NAME, A) ((void)0)
+# define PROBE2(NAME, A, B) ((void)0)
+# define PROBE3(NAME, A, B, C) ((void)0)
+#endif
@@ -0,0 +1,134 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef RADHARC_STATUS_H
+#define RADHARC_STATUS_H
+
+#include <errno.h>
+#include <stdint.h>
+
+
+
+/**
+ * The version of the layout of `struct status`
+ */
+#define STATUS_VERSION 1
+
+/**
+ * The number of times `status_read` tries to
+ * get a consistent copy of the state before
+ * it gives up
+ */
+#define STATUS_READ_ATTEMPTS 1000
+
+
+
+/**
+ * The state published, with -o, in a memory-mapped
+ * file that other processes can map to read the
+ * currently applied colour without querying the
+ * display server or radharc, this header is
+ * installed for such programs
+ * 
+ * The file is protected by a sequence lock: readers
+ * shall use `status_read`, or otherwise read `.sequence`,
+ * with acquire semantics, before copying the rest of
+ * the structure and again afterwards, and retry if it
+ * was odd or if it changed
+ */
+struct status
+{
+	/**
+	 * The sequence lock, odd while the
+	 * structure is being updated
+	 */
+	uint64_t sequence;
+
+	/**
+	 * The number of times the state has been
+	 * published, 0 if it has not been yet
+	 */
+	uint64_t generation;
+
+	/**
+	 * The time, in nanoseconds since the Epoch,
+	 * of `CLOCK_REALTIME`, the state was published
+	 */
+	int64_t time_ns;
+
+	/**
+	 * `STATUS_VERSION`
+	 */
+	uint32_t version;
+
+	/**
+	 * The process ID of the radharc process that
+	 * publishes the state, 0 if the process has
+	 * exited, in which case the rest of the state
+	 * is what it last published and may no longer
+	 * be applied
+	 */
+	int32_t pid;
+
+	/**
+	 * The colour temperature, in kelvins
+	 */
+	double temperature;
+
+	/**
+	 * The Sun's elevation, in degrees, that the colour
+	 * temperature was calculated from, NaN if it was
+	 * not calculated from the Sun's elevation
+	 */
+	double elevation;
+
+	/**
+	 * The red brightness of the colour temperature
+	 */
+	double red;
+
+	/**
+	 * The green brightness of the colour temperature
+	 */
+	double green;
+
+	/**
+	 * The blue brightness of the colour temperature
+	 */
+	double blue;
+};
+
+
+
+/**
+ * Read a consistent copy of a published state
+ * 
+ * Fails if the state is being updated throughout
+ * `STATUS_READ_ATTEMPTS` attempts, which may also
+ * happen if the publishing process was killed
+ * in the middle of an update
+ * 
+ * @param   shared  The memory-mapped state
+ * @param   out     Output parameter for the state
+ * @return          Zero on success, -1 on error,
+ *                  with `errno` set to `EAGAIN`
+ */
+static inline int
+status_read(const struct status *shared, struct status *out)
+{
+	uint64_t seq;
+	int i;
+	for (i = 0; i < STATUS_READ_ATTEMPTS; i++) {
+		seq = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		*out = *shared;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == seq) {
+			out->sequence = seq;
+			return 0;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+#endif
@@ -1,10 +1,27 @@
 /* See LICENSE file for copyright and license details. */
+#include "alloc-check.h"
+#include "blackbody.h"
 #include "cg-base.h"
+#include "metrics.h"
+#include "status.h"
+#include "probes.h"
 
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
+#include <alloca.h>
+#include <ctype.h>
 #include <errno.h>
+#include <float.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libclut.h>
@@ -30,54 +47,228 @@ const char *const *class_suffixes = (const char *const[]){NULL};
  */
 static unsigned long int fade_in_cs = 0;
 
+/**
+ * The number of milliseconds of the fade-in that
+ * have been applied, so that the fade-in resumes,
+ * rather than restarts, if the filters are
+ * reconfigured during it
+ */
+static double fade_in_elapsed = 0;
+
 /**
  * The effect fade-out time, in centiseconds
  */
 static unsigned long int fade_out_cs = 0;
 
 /**
- * The highest elevation of the Sun where the lowest
- * colour temperature is applied
+ * The highest number of frames per second during fades
+ */
+static double max_frame_rate = 100;
+
+/**
+ * The lowest number of frames per second during fades
+ */
+static double min_frame_rate = 10;
+
+/**
+ * The number of milliseconds a wakeup may be deferred, so that
+ * it can be coalesced with other wakeups on the system, as
+ * specified with the -s flag, negative if not specified
+ */
+static double timer_slack = -1;
+
+/**
+ * The number of seconds between checks, in the steady state, that the
+ * filters on a CRTC are still applied, as specified with the -i flag;
+ * each check reads back the filters on the next CRTC, and unchanged
+ * gamma ramps are only resent to CRTC:s where they have been removed
+ * or changed; 0 if the gamma ramps shall be resent at each update
+ */
+static double verify_interval = 60;
+
+/**
+ * The maximum number of gamma ramp updates per second and CRTC
+ * for micro-transitions in the steady state, as specified with
+ * the -u flag, 0 if temperature changes are applied as steps
+ */
+static double micro_rate = 0;
+
+/**
+ * The maximum number of milliseconds a temperature
+ * change is spread over in the steady state, if
+ * micro-transitions are enabled with -u; it is
+ * shortened so that it ends before the next update
+ */
+#define MICRO_TRANSITION_MS 5000
+
+/**
+ * The wall clock time, in seconds since the Epoch, the simulation
+ * selected with the -T flag starts at, NaN if not simulating
+ */
+static double simulation_start = NAN;
+
+/**
+ * The number of simulated seconds per real second,
+ * 0 to simulate as fast as possible
+ */
+static double simulation_speed = 0;
+
+/**
+ * The number of simulated milliseconds that have passed
+ */
+static double simulated_ms = 0;
+
+/**
+ * The time, of `CLOCK_MONOTONIC`, in
+ * milliseconds, the simulation started
+ */
+static double simulation_real_start;
+
+/**
+ * The number of frames computed during the simulation
+ */
+static uint64_t simulated_frames = 0;
+
+/**
+ * The number of filter updates sent during the simulation
+ */
+static uint64_t simulated_updates = 0;
+
+/**
+ * The number of seconds spent computing
+ * gamma ramps during the simulation
+ */
+static double simulated_compute_time = 0;
+
+/**
+ * The brightness, applied after the colour temperature,
+ * as specified with the -b flag
  */
-static double low_elev = -6;
+static double brightness = 1;
 
 /**
- * The lowest colour temperature that may be applied
+ * The contrast, applied after the colour temperature,
+ * as specified with the -k flag
  */
-static double low_temp = 2500;
+static double contrast = 1;
 
 /**
- * The lowest elevation of the Sun where the highest
- * colour temperature is applied
+ * The gamma, applied after the colour temperature,
+ * as specified with the -g flag
  */
-static double high_elev = 3;
+static double gamma_correction = 1;
 
 /**
- * The highest colour temperature that may be applied
+ * Whether any of `brightness`, `contrast`,
+ * and `gamma_correction` is not 1
  */
-static double high_temp = 5000;
+static int have_adjustments = 0;
 
 /**
- * The temperature choosen with the -f flag, negative if none
+ * A point in a schedule loaded with the -e flag
  */
-static double choosen_temperature = -1;
+struct schedule_point
+{
+	/**
+	 * The time of day, in seconds since midnight, local time
+	 */
+	double time;
+
+	/**
+	 * The colour temperature at `.time`
+	 */
+	double temperature;
+};
 
 /**
- * The latitude coordiate of the GPS coordiates of
- * the user's location
+ * Colour temperature settings, either the default
+ * settings or overrides, selected with the -P
+ * flag, for CRTC:s matching a pattern
+ * 
+ * In overrides, unspecified values are NaN until
+ * inherited from the default settings
  */
-static double latitude;
+struct profile
+{
+	/**
+	 * The pattern the names of the CRTC:s the settings
+	 * apply to shall match, `NULL` for the default settings
+	 */
+	const char *crtcs;
+
+	/**
+	 * The highest elevation of the Sun where the lowest
+	 * colour temperature is applied
+	 */
+	double low_elev;
+
+	/**
+	 * The lowest colour temperature that may be applied
+	 */
+	double low_temp;
+
+	/**
+	 * The lowest elevation of the Sun where the highest
+	 * colour temperature is applied
+	 */
+	double high_elev;
+
+	/**
+	 * The highest colour temperature that may be applied
+	 */
+	double high_temp;
+
+	/**
+	 * The temperature choosen with the -t flag, negative
+	 * if the location or the schedule is used instead
+	 */
+	double choosen_temperature;
+
+	/**
+	 * The schedule loaded with the -e flag, sorted by
+	 * time of day, `NULL` if the location or -t is used
+	 */
+	struct schedule_point *schedule;
+
+	/**
+	 * The number of elements in `.schedule`
+	 */
+	size_t schedule_n;
+
+	/**
+	 * The latitude coordiate of the GPS coordiates of
+	 * the user's location, NaN if not specified
+	 */
+	double latitude;
+
+	/**
+	 * The longitude coordiate of the GPS coordiates of
+	 * the user's location, NaN if not specified
+	 */
+	double longitude;
+
+	/**
+	 * Whether any CRTC uses these settings; profiles with
+	 * identical settings are merged, only the first is used
+	 */
+	int used;
+
+	/**
+	 * The current colour temperature
+	 */
+	double temperature;
+};
 
 /**
- * The longitude coordiate of the GPS coordiates of
- * the user's location
+ * The default settings followed by the
+ * overrides in the order they were specified
  */
-static double longitude;
+static struct profile *profiles = NULL;
 
 /**
- * Whether the user's location has been specified
+ * The number of elements in `profiles`
  */
-static int have_location = 0;
+static size_t profiles_n = 0;
 
 /**
  * Whether the -d flag (keep process running and remove
@@ -91,6 +282,71 @@ static int dflag = 0;
  */
 static int xflag = 0;
 
+/**
+ * Whether the -n flag has been specified: use real-time
+ * scheduling and locked memory during fades, and the
+ * idle scheduling policy in the steady state
+ */
+static int nflag = 0;
+
+/**
+ * The pathname of the socket to serve metrics
+ * on, as specified with the -m flag, or `NULL`
+ */
+static const char *metrics_socket = NULL;
+
+/**
+ * The pathname of the file to publish the applied
+ * colour in, as specified with the -o flag, or `NULL`
+ */
+static const char *status_path = NULL;
+
+/**
+ * Statistics collected during a fade, if -v has been specified
+ */
+struct fade_stats
+{
+	/**
+	 * The time, in milliseconds since the fade
+	 * started, the last frame was acknowledged
+	 */
+	double last;
+
+	/**
+	 * The time, in milliseconds, between each
+	 * pair of consecutively acknowledged frames
+	 */
+	double *intervals;
+
+	/**
+	 * The number of acknowledged frames
+	 */
+	size_t frames;
+
+	/**
+	 * The number of timer ticks without a frame
+	 */
+	uint64_t dropped;
+
+	/**
+	 * The time, in milliseconds, each wakeup
+	 * between frames came after its deadline
+	 */
+	double *lateness;
+
+	/**
+	 * The sum of the deviations, in kelvins,
+	 * from the ideal fade curve
+	 */
+	double deviation_sum;
+
+	/**
+	 * The largest deviation, in kelvins,
+	 * from the ideal fade curve
+	 */
+	double deviation_max;
+};
+
 /**
  * Print usage information and exit
  */
@@ -98,9 +354,13 @@ void
 usage(void)
 {
 	fprintf(stderr,
-	        "usage: %s [-M method] [-S site] [-c crtc]... [-R rule] [-p priority]"
+	        "usage: %s [-M method] [-S site]... [-c crtc]... [-R rule] [-p priority] [-w recording] [-C]"
 	        " [-f fade-in] [-F fade-out] [-h [high-temp][@high-elev]] [-l [low-temp][@low-elev]]"
-	        " (-L latitude:longitude | -t temperature [-d] | -x)\n", argv0);
+	        " [-b brightness] [-k contrast] [-g gamma] [-i verify-interval] [-m metrics-socket]"
+	        " [-n] [-o status-file] [-r max-frame-rate[:min-frame-rate]] [-s timer-slack] [-T date[:speed]] [-u update-rate] [-v]"
+	        " (-L latitude:longitude | -e schedule-file | -t temperature [-d] | -x)"
+	        " [-P crtc-pattern [-h [high-temp][@high-elev]] [-l [low-temp][@low-elev]]"
+	        " [-L latitude:longitude | -e schedule-file | -t temperature]]...\n", argv0);
 	exit(1);
 }
 
@@ -124,13 +384,196 @@ parse_double(double *out, const char *str)
 	return 0;
 }
 
+/**
+ * Parse the argument of the -T flag
+ * 
+ * The argument is the date, as YYYY-MM-DD, whose local
+ * midnight the simulation starts at, or @ followed by
+ * the number of seconds since the Epoch the simulation
+ * starts at, optionally followed by a colon and the
+ * simulation speed, 0 (the default) for as fast as possible
+ * 
+ * @param   arg  The argument
+ * @return       Zero on success, -1 if the argument is invalid
+ */
+static int
+parse_simulation(char *arg)
+{
+	struct tm tm;
+	char *p, *end;
+
+	p = strchr(arg, ':');
+	if (p) {
+		*p++ = '\0';
+		if (parse_double(&simulation_speed, p))
+			return -1;
+	}
+
+	if (*arg == '@') {
+		if (parse_double(&simulation_start, &arg[1]))
+			return -1;
+		return 0;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(arg, "%Y-%m-%d", &tm);
+	if (!end || *end)
+		return -1;
+	tm.tm_isdst = -1;
+	simulation_start = (double)mktime(&tm);
+	return 0;
+}
+
+/**
+ * Load a schedule file for the -e flag
+ * 
+ * Each line in the file is either empty, a comment starting
+ * with '#', or a time of day, as HH:MM or HH:MM:SS local time,
+ * followed by whitespace and a colour temperature, within the
+ * range of the blackbody table; between the points, the
+ * temperature is interpolated linearly, two points at the
+ * same time of day make a step
+ * 
+ * @param   profile  The profile to load the schedule into
+ * @param   path     The pathname of the schedule file
+ * @return           Zero on success, -1 on error
+ */
+static int
+load_schedule(struct profile *profile, const char *path)
+{
+	FILE *f;
+	char *line = NULL, *p, *end;
+	size_t size = 0, lineno = 0, i, j;
+	unsigned long int hh, mm, ss;
+	struct schedule_point *new, point;
+	ssize_t len;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+		goto custom_fail;
+	}
+
+	free(profile->schedule);
+	profile->schedule = NULL;
+	profile->schedule_n = 0;
+
+	while ((len = getline(&line, &size, f)) >= 0) {
+		lineno++;
+		for (p = line; isspace(*p); p++);
+		if (!*p || *p == '#')
+			continue;
+		hh = strtoul(p, &end, 10);
+		if (end == p || *end != ':' || hh > 23)
+			goto invalid;
+		p = &end[1];
+		mm = strtoul(p, &end, 10);
+		if (end == p || mm > 59)
+			goto invalid;
+		ss = 0;
+		if (*end == ':') {
+			p = &end[1];
+			ss = strtoul(p, &end, 10);
+			if (end == p || ss > 59)
+				goto invalid;
+		}
+		if (!isspace(*end))
+			goto invalid;
+		for (p = end; isspace(*p); p++);
+		for (end = &line[len]; end > p && isspace(end[-1]); end--);
+		*end = '\0';
+
+		new = realloc(profile->schedule, (profile->schedule_n + 1) * sizeof(*new));
+		if (!new)
+			goto fail;
+		profile->schedule = new;
+		new = &new[profile->schedule_n++];
+		new->time = (double)(hh * 60 * 60 + mm * 60 + ss);
+		if (parse_double(&new->temperature, p))
+			goto invalid;
+		if (!(new->temperature >= BLACKBODY_LOWEST && new->temperature <= BLACKBODY_HIGHEST))
+			goto invalid;
+	}
+	if (ferror(f))
+		goto fail;
+	if (!profile->schedule_n) {
+		fprintf(stderr, "%s: %s: schedule is empty\n", argv0, path);
+		goto custom_fail;
+	}
+
+	/* insertion sort, it is stable, so steps are kept in order */
+	for (i = 1; i < profile->schedule_n; i++) {
+		point = profile->schedule[i];
+		for (j = i; j && profile->schedule[j - 1].time > point.time; j--)
+			profile->schedule[j] = profile->schedule[j - 1];
+		profile->schedule[j] = point;
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: %s:%zu: invalid schedule line\n", argv0, path, lineno);
+	goto custom_fail;
+fail:
+	fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+custom_fail:
+	free(line);
+	if (f)
+		fclose(f);
+	errno = 0;
+	return -1;
+}
+
+/**
+ * Start a new set of colour temperature settings,
+ * or the default settings if there are none yet
+ * 
+ * @param   crtcs  The pattern for the CRTC:s the settings
+ *                 apply to, `NULL` for the default settings
+ * @return         Zero on success, -1 on error
+ */
+static int
+add_profile(const char *crtcs)
+{
+	struct profile *new = realloc(profiles, (profiles_n + 1) * sizeof(*profiles));
+	if (!new)
+		return -1;
+	profiles = new;
+	new = &profiles[profiles_n++];
+	memset(new, 0, sizeof(*new));
+	new->crtcs = crtcs;
+	if (crtcs) {
+		new->low_elev            = NAN;
+		new->low_temp            = NAN;
+		new->high_elev           = NAN;
+		new->high_temp           = NAN;
+		new->choosen_temperature = NAN;
+	} else {
+		new->low_elev            = -6;
+		new->low_temp            = 2500;
+		new->high_elev           = 3;
+		new->high_temp           = 5000;
+		new->choosen_temperature = -1;
+	}
+	new->latitude  = NAN;
+	new->longitude = NAN;
+	return 0;
+}
+
 /**
  * Handle a command line option
  * 
+ * Until -P is used, -e, -h, -l, -L, and -t
+ * set the default settings, after -P they
+ * only apply to the CRTC:s it selects
+ * 
  * @param   opt  The option, it is a NUL-terminate two-character
  *               string starting with either '-' or '+', if the
  *               argument is not recognised, call `usage`. This
- *               string will not be "-M", "-S", "-c", "-p", or "-R".
+ *               string will not be "-M", "-S", "-c", "-p", "-R",
+ *               "-w", "-C", or "-v".
  * @param   arg  The argument associated with `opt`,
  *               `NULL` there is no next argument, if this
  *               parameter is `NULL` but needed, call `usage`
@@ -141,14 +584,34 @@ parse_double(double *out, const char *str)
 int
 handle_opt(char *opt, char *arg)
 {
+	struct profile *profile;
 	double t;
 	char *p;
+	if (!profiles_n && add_profile(NULL))
+		return -1;
+	profile = &profiles[profiles_n - 1];
 	if (opt[0] == '-') {
 		switch (opt[1]) {
+		case 'b':
+			if (parse_double(&brightness, arg))
+				usage();
+			have_adjustments = 1;
+			return 1;
 		case 'd':
 			dflag = 1;
 			xflag = 0;
 			break;
+		case 'e':
+			if (!arg)
+				usage();
+			if (load_schedule(profile, arg))
+				return -1;
+			profile->choosen_temperature = -1;
+			profile->latitude = NAN;
+			profile->longitude = NAN;
+			dflag = 0;
+			xflag = 0;
+			return 1;
 		case 'f':
 			if (parse_double(&t, arg))
 				usage();
@@ -159,43 +622,104 @@ handle_opt(char *opt, char *arg)
 				usage();
 			fade_out_cs = (unsigned long int)(t * 100 + 0.5);
 			return 1;
+		case 'g':
+			if (parse_double(&gamma_correction, arg) || !gamma_correction)
+				usage();
+			have_adjustments = 1;
+			return 1;
 		case 'h':
 			p = strchr(arg, '@');
 			if (p)
 				*p++ = '\0';
-			if (*arg && parse_double(&high_temp, arg))
+			if (*arg && parse_double(&profile->high_temp, arg))
+				usage();
+			if (p && parse_double(&profile->high_elev, p))
+				usage();
+			return 1;
+		case 'i':
+			if (parse_double(&verify_interval, arg))
 				usage();
-			if (p && parse_double(&high_elev, p))
+			return 1;
+		case 'k':
+			if (parse_double(&contrast, arg))
 				usage();
+			have_adjustments = 1;
 			return 1;
 		case 'l':
 			p = strchr(arg, '@');
 			if (p)
 				*p++ = '\0';
-			if (*arg && parse_double(&low_temp, arg))
+			if (*arg && parse_double(&profile->low_temp, arg))
+				usage();
+			if (p && parse_double(&profile->low_elev, p))
+				usage();
+			return 1;
+		case 'm':
+			if (!arg)
+				usage();
+			metrics_socket = arg;
+			return 1;
+		case 'n':
+			nflag = 1;
+			break;
+		case 'o':
+			if (!arg)
+				usage();
+			status_path = arg;
+			return 1;
+		case 'P':
+			if (!arg || !*arg)
+				usage();
+			if (add_profile(arg))
+				return -1;
+			return 1;
+		case 'r':
+			p = strchr(arg, ':');
+			if (p)
+				*p++ = '\0';
+			if (parse_double(&max_frame_rate, arg) || !max_frame_rate || max_frame_rate > 1000)
 				usage();
-			if (p && parse_double(&low_elev, p))
+			if (p && (parse_double(&min_frame_rate, p) || !min_frame_rate))
 				usage();
+			if (min_frame_rate > max_frame_rate)
+				min_frame_rate = max_frame_rate;
 			return 1;
 		case 'L':
 			p = strchr(arg, ':');
 			if (!p)
 				usage();
 			*p++ = '\0';
-			if (parse_double(&latitude, arg) || latitude < -90 || latitude > 90)
+			if (parse_double(&profile->latitude, arg) || profile->latitude < -90 || profile->latitude > 90)
 				usage();
-			if (parse_double(&longitude, p) || longitude < -180 || longitude > 180)
+			if (parse_double(&profile->longitude, p) || profile->longitude < -180 || profile->longitude > 180)
 				usage();
-			choosen_temperature = -1;
-			have_location = 1;
+			profile->choosen_temperature = -1;
+			free(profile->schedule);
+			profile->schedule = NULL;
+			profile->schedule_n = 0;
 			dflag = 0;
 			xflag = 0;
 			return 1;
+		case 's':
+			if (parse_double(&timer_slack, arg))
+				usage();
+			return 1;
+		case 'T':
+			if (parse_simulation(arg))
+				usage();
+			return 1;
 		case 't':
-			if (parse_double(&choosen_temperature, arg))
+			if (parse_double(&profile->choosen_temperature, arg))
 				usage();
+			free(profile->schedule);
+			profile->schedule = NULL;
+			profile->schedule_n = 0;
 			xflag = 0;
 			return 1;
+		case 'u':
+			if (parse_double(&micro_rate, arg))
+				usage();
+			return 1;
 		case 'x':
 			xflag = 1;
 			dflag = 0;
@@ -221,16 +745,167 @@ handle_opt(char *opt, char *arg)
 int
 handle_args(int argc, char *argv[], char *prio)
 {
-	if (argc || (!xflag && !have_location && choosen_temperature < 0))
+	struct profile *profile;
+	size_t i;
+
+	if (!profiles_n && add_profile(NULL))
+		return -1;
+	if (argc)
 		usage();
+
+	for (i = 0; i < profiles_n; i++) {
+		profile = &profiles[i];
+		if (isnan(profile->low_elev))
+			profile->low_elev = profiles->low_elev;
+		if (isnan(profile->low_temp))
+			profile->low_temp = profiles->low_temp;
+		if (isnan(profile->high_elev))
+			profile->high_elev = profiles->high_elev;
+		if (isnan(profile->high_temp))
+			profile->high_temp = profiles->high_temp;
+		if (isnan(profile->choosen_temperature)) {
+			profile->choosen_temperature = profiles->choosen_temperature;
+			profile->latitude = profiles->latitude;
+			profile->longitude = profiles->longitude;
+			profile->schedule = profiles->schedule;
+			profile->schedule_n = profiles->schedule_n;
+		}
+		if (!xflag && isnan(profile->latitude) && profile->choosen_temperature < 0 && !profile->schedule)
+			usage();
+	}
+
+	/* Without -d, a fade, or a calculated colour temperature, the
+	 * filters are applied once, and can be sent as soon as each
+	 * CRTC's information has arrived, see `fill_oneshot` */
+	oneshot = !dflag && !fade_in_cs && isnan(simulation_start) && !metrics_socket;
+	for (i = 0; i < profiles_n && oneshot; i++)
+		if (!(profiles[i].choosen_temperature >= BLACKBODY_LOWEST && profiles[i].choosen_temperature <= BLACKBODY_HIGHEST))
+			oneshot = 0;
+	oneshot |= xflag;
+
 	return 0;
 	(void) argv;
 	(void) prio;
 }
 
+/**
+ * Select the colour temperature settings for a
+ * filter, by setting the filter's group to the
+ * index of the settings in `profiles`, so that
+ * only filters with identical settings share ramps
+ * 
+ * If the settings are identical to an earlier
+ * profile, the earlier profile is selected, and
+ * `.used` is set for the selected profile
+ * 
+ * @param   index  The index of the filter
+ * @return         The index of the selected profile
+ */
+static size_t
+select_profile(size_t index)
+{
+	size_t j, k;
+	struct profile *a, *b;
+
+	for (j = profiles_n; --j;)
+		if (!fnmatch(profiles[j].crtcs, crtc_updates[index].filter.crtc, 0))
+			break;
+	for (k = 0; k < j; k++) {
+		a = &profiles[j];
+		b = &profiles[k];
+		if (a->low_elev == b->low_elev && a->low_temp == b->low_temp &&
+		    a->high_elev == b->high_elev && a->high_temp == b->high_temp &&
+		    a->choosen_temperature == b->choosen_temperature &&
+		    (a->choosen_temperature >= 0 ||
+		     (a->schedule ? a->schedule == b->schedule :
+		      (a->latitude == b->latitude && a->longitude == b->longitude))))
+			break;
+	}
+	crtc_updates[index].group = k;
+	profiles[k].used = 1;
+	return k;
+}
+
+/**
+ * Select the colour temperature settings for each
+ * filter, see `select_profile`, and set `.used`
+ * only for the profiles that are in use
+ */
+static void
+select_profiles(void)
+{
+	size_t i;
+
+	for (i = 0; i < profiles_n; i++)
+		profiles[i].used = 0;
+
+	for (i = 0; i < filters_n; i++)
+		select_profile(i);
+}
+
+/**
+ * Get the colour of a colour temperature, with linear
+ * interpolation between the elements of the table in
+ * blackbody.h, which is generated from libred's data
+ * 
+ * @param   kelvin  The colour temperature, in kelvins
+ * @param   red     Output parameter for the red brightness
+ * @param   green   Output parameter for the green brightness
+ * @param   blue    Output parameter for the blue brightness
+ * @return          0 on success, -1 on failure
+ * 
+ * @throws  EDOM  The colour temperature is out of range
+ */
+static inline int
+get_colour(double kelvin, double *red, double *green, double *blue)
+{
+	double pos, frac;
+	size_t i;
+
+	if (!(kelvin >= BLACKBODY_LOWEST && kelvin <= BLACKBODY_HIGHEST)) {
+		errno = EDOM;
+		return -1;
+	}
+
+	pos = (kelvin - BLACKBODY_LOWEST) / BLACKBODY_STEP;
+	i = (size_t)pos;
+	if (i == sizeof(blackbody_table) / sizeof(*blackbody_table) - 1) {
+		*red   = blackbody_table[i][0];
+		*green = blackbody_table[i][1];
+		*blue  = blackbody_table[i][2];
+		return 0;
+	}
+
+	frac = pos - (double)i;
+	*red   = blackbody_table[i][0] + frac * (blackbody_table[i + 1][0] - blackbody_table[i][0]);
+	*green = blackbody_table[i][1] + frac * (blackbody_table[i + 1][1] - blackbody_table[i][1]);
+	*blue  = blackbody_table[i][2] + frac * (blackbody_table[i + 1][2] - blackbody_table[i][2]);
+	return 0;
+}
+
+/**
+ * Apply the brightness, contrast, and gamma
+ * specified with -b, -k, and -g to a ramp stop
+ * 
+ * @param   v  The value of the ramp stop, in standard RGB
+ * @return     The adjusted value, not clipped
+ */
+static inline double
+adjust(double v)
+{
+	if (!have_adjustments)
+		return v;
+	if (gamma_correction != 1 && v > 0)
+		v = pow(v, 1 / gamma_correction);
+	return ((v - 0.5) * contrast + 0.5) * brightness;
+}
+
 /**
  * Fill a filter
  * 
+ * The colour temperature and the adjustments specified
+ * with -b, -k, and -g are applied in the same pass
+ * 
  * @param  filter  The filter to fill
  * @param  red     The red brightness
  * @param  green   The green brightness
@@ -239,165 +914,1443 @@ handle_args(int argc, char *argv[], char *prio)
 static void
 fill_filter(libcoopgamma_filter_t *restrict filter, double red, double green, double blue)
 {
+	size_t sizes[3], ch, i;
+	double rgb[3], v;
+	sizes[0] = filter->ramps.u8.red_size;
+	sizes[1] = filter->ramps.u8.green_size;
+	sizes[2] = filter->ramps.u8.blue_size;
+	rgb[0] = red;
+	rgb[1] = green;
+	rgb[2] = blue;
+
+#define STOPS (sizes[0] + sizes[1] + sizes[2])
+	PROBE2(fill_filter_entry, (int)filter->depth, STOPS);
 	switch (filter->depth) {
 #define X(CONST, MEMBER, MAX, TYPE)\
 	case CONST:\
-		libclut_start_over(&(filter->ramps.MEMBER), MAX, TYPE, 1, 1, 1);\
-		libclut_linearise(&(filter->ramps.MEMBER), MAX, TYPE, 1, 1, 1);\
-		libclut_rgb_brightness(&(filter->ramps.MEMBER), MAX, TYPE, red, green, blue);\
-		libclut_standardise(&(filter->ramps.MEMBER), MAX, TYPE, 1, 1, 1);\
+		for (ch = 0; ch < 3; ch++) {\
+			TYPE *ramp = !ch ? filter->ramps.MEMBER.red : ch == 1 ? filter->ramps.MEMBER.green : filter->ramps.MEMBER.blue;\
+			for (i = 0; i < sizes[ch]; i++) {\
+				v = sizes[ch] > 1 ? (double)i / (double)(sizes[ch] - 1) : 0;\
+				v = adjust(libclut_model_linear_to_standard1(rgb[ch] * libclut_model_standard_to_linear1(v)));\
+				ramp[i] = v <= 0 ? (TYPE)0 : v >= 1 ? (TYPE)MAX : (TYPE)(v * MAX);\
+			}\
+		}\
 		break;
 LIST_DEPTHS
 #undef X
 	default:
 		abort();
 	}
+	PROBE2(fill_filter_exit, (int)filter->depth, STOPS);
+#undef STOPS
 }
 
 /**
- * Set the gamma ramps
+ * Fill the linear-domain ramps of a filter for a colour,
+ * for use as an endpoint in `blend_filter`
  * 
- * @param   red    The red brightness
- * @param   green  The green brightness
- * @param   blue   The blue brightness
- * @return         0: Success
- *                 -1: Error, `errno` set
- *                 -2: Error, `cg.error` set
- *                 -3: Error, message already printed
+ * @param  out     Output buffer, with one element per ramp stop,
+ *                 the red ramp first and the blue ramp last
+ * @param  filter  The filter
+ * @param  rgb     The red, green, and blue brightness, in linear RGB
  */
-static int
-set_ramps(double red, double green, double blue)
+static void
+fill_endpoint(double *restrict out, const libcoopgamma_filter_t *restrict filter, const double rgb[3])
 {
-	int r;
-	size_t i, j;
-
-	libclut_model_standard_to_linear(&red, &green, &blue);
-	for (i = 0, r = 1; i < filters_n; i++) {
-		if (!(crtc_updates[i].master) || !(crtc_info[crtc_updates[i].crtc].supported))
-			continue;
-		fill_filter(&(crtc_updates[i].filter), red, green, blue);
-		r = update_filter(i, 0);
-		if (r == -2 || (r == -1 && errno != EAGAIN))
-			return r;
-		if (crtc_updates[i].slaves) {
-			for (j = 0; crtc_updates[i].slaves[j] != 0; j++) {
-				r = update_filter(crtc_updates[i].slaves[j], 0);
-				if (r == -2 || (r == -1 && errno != EAGAIN))
-					return r;
-			}
-		}
-	}
-
-	while (r != 1)
-		if ((r = synchronise(-1)) < 0)
-			return r;
-
-	return 0;
+	size_t sizes[3], ch, i;
+	sizes[0] = filter->ramps.u8.red_size;
+	sizes[1] = filter->ramps.u8.green_size;
+	sizes[2] = filter->ramps.u8.blue_size;
+	for (ch = 0; ch < 3; ch++)
+		for (i = 0; i < sizes[ch]; i++)
+			*out++ = rgb[ch] * libclut_model_standard_to_linear1(sizes[ch] > 1 ? (double)i / (double)(sizes[ch] - 1) : 0);
 }
 
 /**
- * Get the colour temperature for the current time
+ * Fill a filter by blending, per channel, two sets of
+ * linear-domain ramps created with `fill_endpoint`
  * 
- * @param   tp  Output parameter for the colour temperature
- * @return      0 on success, -1 on failure
+ * The ramps are linear in the brightness of each channel,
+ * so with weights calculated from the exact colour, the
+ * result only differs by floating-point rounding from
+ * that of `fill_filter`, including the adjustments
+ * specified with -b, -k, and -g
+ * 
+ * @param  filter  The filter to fill
+ * @param  start   The ramps at weight 0
+ * @param  end     The ramps at weight 1
+ * @param  w       The weight of `end` for the red, green, and blue channel
  */
-static int
-get_temperature(double *tp)
+static void
+blend_filter(libcoopgamma_filter_t *restrict filter, const double *restrict start,
+             const double *restrict end, const double w[3])
 {
-	if (choosen_temperature < 0) {
-		if (libred_solar_elevation(latitude, longitude, tp))
-			return -1;
-		if (*tp < low_elev)
-			*tp = low_elev;
-		if (*tp > high_elev)
-			*tp = high_elev;
-		*tp = (*tp - low_elev) / (high_elev - low_elev);
-		*tp = low_temp + *tp * (high_temp - low_temp);
-	} else {
-		*tp = choosen_temperature;
+	size_t sizes[3], ch, i;
+	double v;
+	sizes[0] = filter->ramps.u8.red_size;
+	sizes[1] = filter->ramps.u8.green_size;
+	sizes[2] = filter->ramps.u8.blue_size;
+
+#define STOPS (sizes[0] + sizes[1] + sizes[2])
+	PROBE2(fill_filter_entry, (int)filter->depth, STOPS);
+	switch (filter->depth) {
+#define X(CONST, MEMBER, MAX, TYPE)\
+	case CONST:\
+		for (ch = 0; ch < 3; ch++) {\
+			TYPE *ramp = !ch ? filter->ramps.MEMBER.red : ch == 1 ? filter->ramps.MEMBER.green : filter->ramps.MEMBER.blue;\
+			for (i = 0; i < sizes[ch]; i++, start++, end++) {\
+				v = adjust(libclut_model_linear_to_standard1(*start + w[ch] * (*end - *start)));\
+				ramp[i] = v <= 0 ? (TYPE)0 : v >= 1 ? (TYPE)MAX : (TYPE)(v * MAX);\
+			}\
+		}\
+		break;
+LIST_DEPTHS
+#undef X
+	default:
+		abort();
 	}
-	return 0;
+	PROBE2(fill_filter_exit, (int)filter->depth, STOPS);
+#undef STOPS
 }
 
-
 /**
- * The main function for the program-specific code
+ * Get the current time of `CLOCK_MONOTONIC`
+ * 
+ * @return  The current time, in milliseconds
+ */
+static double
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000 + (double)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Get the current time of the time source, which is
+ * `CLOCK_MONOTONIC` unless -T has been specified,
+ * in which case it is the simulated time
+ * 
+ * @return  The current time, in milliseconds, only
+ *          differences between values are meaningful
+ */
+static double
+clock_ms(void)
+{
+	if (isnan(simulation_start))
+		return monotonic_ms();
+	if (simulation_speed)
+		simulated_ms = (monotonic_ms() - simulation_real_start) * simulation_speed;
+	return simulated_ms;
+}
+
+/**
+ * Get the current wall clock time of the time source,
+ * which is simulated if -T has been specified
+ * 
+ * @return  The number of seconds since the Epoch
+ */
+static double
+wall_time(void)
+{
+	struct timespec ts;
+	if (!isnan(simulation_start))
+		return simulation_start + clock_ms() / 1000;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+/**
+ * Wait until a point in time of the time source
+ * 
+ * When simulating as fast as possible, the simulated
+ * time is advanced to `deadline` without waiting
+ * 
+ * @param   tfd       A timer created with `timerfd_create(CLOCK_MONOTONIC, 0)`
+ * @param   deadline  The time, as returned by `clock_ms`, to wait until
+ * @return            Zero on success, -1 on error
+ */
+static int
+sleep_until(int tfd, double deadline)
+{
+	struct itimerspec timeout;
+	struct pollfd pollfd;
+	uint64_t overrun;
+
+	if (!isnan(simulation_start)) {
+		if (!simulation_speed) {
+			if (deadline > simulated_ms)
+				simulated_ms = deadline;
+			return 0;
+		}
+		deadline = simulation_real_start + deadline / simulation_speed;
+	}
+
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.it_value.tv_sec = (time_t)(deadline / 1000);
+	timeout.it_value.tv_nsec = (long int)((deadline - (double)timeout.it_value.tv_sec * 1000) * 1000000);
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &timeout, NULL))
+		return -1;
+
+	pollfd.fd = tfd;
+	pollfd.events = POLLIN;
+	if (metrics_enabled && metrics_wait(&pollfd, 1, -1) < 0)
+		return -1;
+	if (read(tfd, &overrun, sizeof(overrun)) != sizeof(overrun))
+		return -1;
+	return 0;
+}
+
+/**
+ * Fill the gamma ramps of all filters, without sending them
+ * 
+ * @param  fill  Function that fills the gamma ramps of
+ *               the filter with the index specified in
+ *               the first argument, using `args`
+ * @param  args  The second argument for `fill`, indexed
+ *               by the group of the filter
+ */
+static void
+fill_ramps(void (*fill)(size_t, const double[3]), const double (*args)[3])
+{
+	size_t i;
+	double compute_time = 0, t;
+
+	for (i = 0; i < filters_n; i++) {
+		if (!(crtc_updates[i].master) || !(crtc_info[crtc_updates[i].crtc].supported))
+			continue;
+		if (metrics_enabled || !isnan(simulation_start)) {
+			t = metrics_now();
+			fill(i, args[crtc_updates[i].group]);
+			compute_time += metrics_now() - t;
+		} else {
+			fill(i, args[crtc_updates[i].group]);
+		}
+	}
+
+	if (metrics_enabled)
+		metrics_record(&metrics.frame_compute, compute_time);
+	if (!isnan(simulation_start))
+		simulated_compute_time += compute_time;
+}
+
+/**
+ * Send the gamma ramps of all filters, as filled by
+ * `fill_ramps`, without waiting for the replies
+ * 
+ * libcoopgamma copies the gamma ramps when a message is
+ * sent, so they may be filled again before the replies
+ * have arrived
+ * 
+ * @return  1: Success, no pending synchronisations
+ *          0: Success, with still pending synchronisations
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ */
+static int
+send_ramps(void)
+{
+	int r;
+	size_t i, j;
+	uint64_t updates = 0;
+
+	for (i = 0, r = 1; i < filters_n; i++) {
+		if (!(crtc_updates[i].master) || !(crtc_info[crtc_updates[i].crtc].supported))
+			continue;
+		r = update_filter(i, 0);
+		if (r == -2 || (r == -1 && errno != EAGAIN))
+			return r;
+		updates++;
+		if (crtc_updates[i].slaves) {
+			for (j = 0; crtc_updates[i].slaves[j] != 0; j++) {
+				r = update_filter(crtc_updates[i].slaves[j], 0);
+				if (r == -2 || (r == -1 && errno != EAGAIN))
+					return r;
+				updates++;
+			}
+		}
+	}
+
+	if (!isnan(simulation_start)) {
+		simulated_frames += 1;
+		simulated_updates += updates;
+	}
+	return r == 1;
+}
+
+/**
+ * Wait until all gamma ramps sent by `send_ramps` have been replied
+ * 
+ * @param   r  The return value of `send_ramps`
+ * @return     0: Success
+ *             -1: Error, `errno` set
+ *             -2: Error, `cg->error` set
+ */
+static int
+await_ramps(int r)
+{
+	while (r != 1)
+		if ((r = synchronise(-1)) < 0)
+			return r;
+	return 0;
+}
+
+/**
+ * Fill and send the gamma ramps of all filters,
+ * and wait until they have been replied
+ * 
+ * @param   fill  Function that fills the gamma ramps of
+ *                the filter with the index specified in
+ *                the first argument, using `args`
+ * @param   args  The second argument for `fill`, indexed
+ *                by the group of the filter
+ * @return        0: Success
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ *                -3: Error, message already printed
+ */
+static int
+apply_ramps(void (*fill)(size_t, const double[3]), const double (*args)[3])
+{
+	int r;
+	fill_ramps(fill, args);
+	if ((r = send_ramps()) < 0)
+		return r;
+	return await_ramps(r);
+}
+
+/**
+ * Fill a filter for a colour, for `apply_ramps`
+ * 
+ * @param  index  The index of the filter
+ * @param  rgb    The red, green, and blue brightness, in linear RGB
+ */
+static void
+fill_colour(size_t index, const double rgb[3])
+{
+	fill_filter(&(crtc_updates[index].filter), rgb[0], rgb[1], rgb[2]);
+}
+
+/**
+ * Fill a filter's gamma ramps, and set its lifespan,
+ * when `oneshot` is set; called once the filter has
+ * been initialised, before it is sent
+ * 
+ * No ramps are shared between filters in this mode,
+ * each filter is filled as soon as its CRTC is known
+ * 
+ * @param  index  The index of the filter
+ */
+void
+fill_oneshot(size_t index)
+{
+	libcoopgamma_filter_t *filter = &crtc_updates[index].filter;
+	struct profile *profile;
+	double rgb[3] = {1, 1, 1};
+
+	if (xflag) {
+		filter->lifespan = LIBCOOPGAMMA_REMOVE;
+	} else {
+		filter->lifespan = LIBCOOPGAMMA_UNTIL_REMOVAL;
+		profile = &profiles[select_profile(index)];
+		profile->temperature = profile->choosen_temperature;
+		get_colour(profile->temperature, &rgb[0], &rgb[1], &rgb[2]);
+		libclut_model_standard_to_linear(&rgb[0], &rgb[1], &rgb[2]);
+	}
+
+	fill_filter(filter, rgb[0], rgb[1], rgb[2]);
+}
+
+/**
+ * Set the gamma ramps
+ * 
+ * @param   rgb  For each element in `profiles`, the red, green, and
+ *               blue brightness, will be converted to linear RGB
+ * @return       0: Success
+ *               -1: Error, `errno` set
+ *               -2: Error, `cg->error` set
+ *               -3: Error, message already printed
+ */
+static int
+set_ramps(double (*rgb)[3])
+{
+	size_t i;
+	for (i = 0; i < profiles_n; i++)
+		libclut_model_standard_to_linear(&rgb[i][0], &rgb[i][1], &rgb[i][2]);
+	return apply_ramps(fill_colour, (const double (*)[3])rgb);
+}
+
+/**
+ * Called each time gamma ramps have been applied,
+ * reports the first time, verifies the CRTC cache
+ * if the CRTC:s were loaded from it, and checks
+ * whether the CRTC:s changed when a site was
+ * reconnected
  * 
  * @return  0: Success
+ *          1: The CRTC configuration has changed
  *          -1: Error, `errno` set
- *          -2: Error, `cg.error` set
+ *          -2: Error, `cg->error` set
+ */
+static int
+ramps_applied(void)
+{
+	static int first = 1;
+	if (crtcs_changed)
+		return 1;
+	if (first) {
+		first = 0;
+		stage_done("apply first gamma ramps");
+	}
+	return verify_crtc_cache();
+}
+
+/**
+ * Look up the colour temperature in a profile's
+ * schedule for the current time, as returned by
+ * `wall_time`, interpolating between the points
+ * around it, which are found by binary search
+ * 
+ * @param   profile  The colour temperature settings, must have a schedule
+ * @param   tp       Output parameter for the colour temperature
+ * @return           The number of seconds until the colour temperature
+ *                   may start to change, 0 if it is changing
+ */
+static double
+schedule_lookup(const struct profile *profile, double *tp)
+{
+	const struct schedule_point *schedule = profile->schedule, *a, *b;
+	size_t lo = 0, hi = profile->schedule_n, mid, n = profile->schedule_n;
+	double now = wall_time(), t, at, bt;
+	time_t secs = (time_t)floor(now);
+	struct tm tm;
+
+	localtime_r(&secs, &tm);
+	t = (double)(tm.tm_hour * 60 * 60 + tm.tm_min * 60 + tm.tm_sec) + (now - (double)secs);
+	t = fmin(t, 24 * 60 * 60 - 0.001);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (schedule[mid].time <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	a = &schedule[lo ? lo - 1 : n - 1];
+	b = &schedule[lo < n ? lo : 0];
+	at = lo ? a->time : a->time - 24 * 60 * 60;
+	bt = lo < n ? b->time : b->time + 24 * 60 * 60;
+
+	*tp = a->temperature + (b->temperature - a->temperature) * (t - at) / (bt - at);
+	return a->temperature == b->temperature ? bt - t : 0;
+}
+
+/**
+ * Get the colour temperature for the current
+ * time, as returned by `wall_time`
+ * 
+ * @param   profile  The colour temperature settings
+ * @param   tp       Output parameter for the colour temperature
+ * @return           0 on success, -1 on failure
+ */
+static int
+get_temperature(const struct profile *profile, double *tp)
+{
+	double jc;
+	if (profile->schedule) {
+		schedule_lookup(profile, tp);
+	} else if (profile->choosen_temperature < 0) {
+		jc = (wall_time() / 86400 + 2440587.5 - 2451545) / 36525;
+		*tp = libred_solar_elevation_from_time(jc, profile->latitude, profile->longitude);
+		if (*tp < profile->low_elev)
+			*tp = profile->low_elev;
+		if (*tp > profile->high_elev)
+			*tp = profile->high_elev;
+		*tp = (*tp - profile->low_elev) / (profile->high_elev - profile->low_elev);
+		*tp = profile->low_temp + *tp * (profile->high_temp - profile->low_temp);
+	} else {
+		*tp = profile->choosen_temperature;
+	}
+	PROBE1(temperature, (long int)*tp);
+	return 0;
+}
+
+/**
+ * Get the colour temperature for the current
+ * time for each element in `profiles` that
+ * is in use, and store it in `.temperature`
+ * 
+ * @return  0 on success, -1 on failure
+ */
+static int
+get_temperatures(void)
+{
+	size_t i;
+	for (i = 0; i < profiles_n; i++)
+		if (profiles[i].used && get_temperature(&profiles[i], &profiles[i].temperature))
+			return -1;
+	return 0;
+}
+
+/**
+ * Signal handler for signals that terminate the
+ * process, marks the published state as stale
+ * and terminates the process with the signal
+ * 
+ * @param  sig  The signal
+ */
+static void
+terminate(int sig)
+{
+	status_stop();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+
+/**
+ * Publish, if -o has been specified, the colour
+ * temperature of the first element in `profiles`
+ * that is in use, once it has been applied
+ * 
+ * @param   kelvin  The colour temperature
+ * @return          0 on success, -1 on failure
+ */
+static int
+publish_status(double kelvin)
+{
+	double jc, elevation = NAN, r, g, b;
+	size_t i;
+
+	if (!status_path)
+		return 0;
+
+	i = 0;
+	while (i < profiles_n && !profiles[i].used)
+		i++;
+	if (i < profiles_n && !profiles[i].schedule && profiles[i].choosen_temperature < 0) {
+		jc = (wall_time() / 86400 + 2440587.5 - 2451545) / 36525;
+		elevation = libred_solar_elevation_from_time(jc, profiles[i].latitude, profiles[i].longitude);
+	}
+
+	if (get_colour(kelvin, &r, &g, &b))
+		return -1;
+	status_publish(kelvin, elevation, r, g, b);
+	return 0;
+}
+
+
+/**
+ * Compare two doubles
+ * 
+ * @param   a_  Return -1 if this one is lower
+ * @param   b_  Return +1 if this one is lower
+ * @return      See `a_` and `b_`, 0 is returned if they are equal
+ */
+static int
+double_cmp(const void *a_, const void *b_)
+{
+	double a = *(const double *)a_;
+	double b = *(const double *)b_;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Record that a frame in the fade has been acknowledged
+ * 
+ * @param  stats        The fade statistics
+ * @param  elapsed      The time, in milliseconds since the fade started,
+ *                      the frame was acknowledged, as measured by `clock_ms`
+ * @param  duration_cs  The duration of the fade, in centiseconds
+ * @param  from         The colour temperature the fade starts at
+ * @param  to           The colour temperature the fade ends at
+ * @param  temperature  The colour temperature of the frame
+ */
+static void
+fade_stats_frame(struct fade_stats *stats, double elapsed, unsigned long int duration_cs,
+                 double from, double to, double temperature)
+{
+	double ideal, deviation;
+
+	if (stats->frames++)
+		stats->intervals[stats->frames - 2] = elapsed - stats->last;
+	stats->last = elapsed;
+
+	elapsed = fmin(elapsed / 10, (double)duration_cs);
+	ideal = from + (to - from) * elapsed / (double)duration_cs;
+	deviation = fabs(temperature - ideal);
+	stats->deviation_sum += deviation;
+	if (deviation > stats->deviation_max)
+		stats->deviation_max = deviation;
+}
+
+/**
+ * Print fade statistics to stderr
+ * 
+ * @param  stats  The fade statistics
+ */
+static void
+fade_stats_print(struct fade_stats *stats)
+{
+	size_t n = stats->frames ? stats->frames - 1 : 0;
+	double *iv = stats->intervals;
+
+	fprintf(stderr, "%s: fade: %zu frames, %" PRIu64 " dropped\n", argv0, stats->frames, stats->dropped);
+	if (n) {
+		qsort(iv, n, sizeof(*iv), double_cmp);
+		fprintf(stderr, "%s: fade: frame interval: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		        argv0, iv[(n - 1) * 50 / 100], iv[(n - 1) * 90 / 100], iv[(n - 1) * 99 / 100], iv[n - 1]);
+	}
+	if (stats->frames) {
+		qsort(stats->lateness, stats->frames, sizeof(*stats->lateness), double_cmp);
+		fprintf(stderr, "%s: fade: timer lateness: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		        argv0, stats->lateness[(stats->frames - 1) * 50 / 100], stats->lateness[(stats->frames - 1) * 90 / 100],
+		        stats->lateness[(stats->frames - 1) * 99 / 100], stats->lateness[stats->frames - 1]);
+		fprintf(stderr, "%s: fade: deviation from ideal curve: mean %.1f K, max %.1f K\n",
+		        argv0, stats->deviation_sum / (double)stats->frames, stats->deviation_max);
+	}
+}
+
+
+/**
+ * Get the smallest change of a ramp stop that is
+ * visible on any of the CRTC:s that are updated
+ * 
+ * @return  The smallest change, relative to the ramp stop's range
+ */
+static double
+ramp_quantum(void)
+{
+	double quantum = 1, q;
+	size_t i;
+
+	for (i = 0; i < filters_n; i++) {
+		if (!crtc_updates[i].master || !crtc_info[crtc_updates[i].crtc].supported)
+			continue;
+		switch (crtc_updates[i].filter.depth) {
+		case LIBCOOPGAMMA_UINT8:  q = 1. / UINT8_MAX;  break;
+		case LIBCOOPGAMMA_UINT16: q = 1. / UINT16_MAX; break;
+		case LIBCOOPGAMMA_UINT32: q = 1. / UINT32_MAX; break;
+		case LIBCOOPGAMMA_UINT64: q = 1. / UINT64_MAX; break;
+		case LIBCOOPGAMMA_FLOAT:  q = FLT_EPSILON;     break;
+		default:                  q = DBL_EPSILON;     break;
+		}
+		if (q < quantum)
+			quantum = q;
+	}
+
+	return quantum;
+}
+
+/**
+ * Select the time until the next frame in a fade
+ * 
+ * The interval is chosen so that the colour changes by
+ * about one ramp quantum per frame, limited by the -r
+ * flag, but never shorter than the time it takes to
+ * compute and apply a frame
+ * 
+ * @param   kelvin    The colour temperature of the current frame
+ * @param   from      The colour temperature the fade starts at
+ * @param   to        The colour temperature the fade ends at
+ * @param   duration  The duration of the fade, in milliseconds
+ * @param   quantum   The value returned by `ramp_quantum`
+ * @param   cost      The time it takes, in milliseconds, to
+ *                    compute and apply a frame
+ * @return            The interval, in milliseconds
+ */
+static double
+fade_interval(double kelvin, double from, double to, double duration, double quantum, double cost)
+{
+	double min_interval = 1000 / max_frame_rate;
+	double max_interval = 1000 / min_frame_rate;
+	double r1, g1, b1, r2, g2, b2, delta, rate, interval;
+	double k2 = kelvin + (to < from ? -100 : 100);
+
+	if (get_colour(kelvin, &r1, &g1, &b1) || get_colour(k2, &r2, &g2, &b2)) {
+		interval = min_interval;
+	} else {
+		delta = fmax(fabs(r2 - r1), fmax(fabs(g2 - g1), fabs(b2 - b1))) / 100;
+		rate = delta * fabs(to - from) / duration;
+		interval = rate > 0 ? quantum / rate : max_interval;
+		interval = fmin(fmax(interval, min_interval), max_interval);
+	}
+
+	return fmax(interval, cost * 1.25);
+}
+
+/**
+ * For each filter that is filled during fades, the linear-domain
+ * ramps for the colour the fade starts at followed by the ramps
+ * for the colour the fade ends at, `NULL` for other filters
+ */
+static double **fade_endpoints = NULL;
+
+/**
+ * Release `fade_endpoints`
+ */
+static void
+release_fade_endpoints(void)
+{
+	size_t i;
+	if (fade_endpoints) {
+		for (i = 0; i < filters_n; i++)
+			free(fade_endpoints[i]);
+		free(fade_endpoints);
+		fade_endpoints = NULL;
+	}
+}
+
+/**
+ * Create or update `fade_endpoints`
+ * 
+ * @param   from  The colour, in linear RGB, the fade starts at,
+ *                `NULL` to only update the colour it ends at
+ * @param   to    The colour, in linear RGB, the fade ends at,
+ *                indexed by the group of the filter
+ * @return        Zero on success, -1 on error
+ */
+static int
+prepare_fade_endpoints(const double from[3], const double (*to)[3])
+{
+	size_t i, n;
+	libcoopgamma_filter_t *filter;
+
+	if (!fade_endpoints) {
+		fade_endpoints = calloc(filters_n, sizeof(*fade_endpoints));
+		if (!fade_endpoints)
+			return -1;
+	}
+
+	for (i = 0; i < filters_n; i++) {
+		if (!crtc_updates[i].master || !crtc_info[crtc_updates[i].crtc].supported)
+			continue;
+		filter = &crtc_updates[i].filter;
+		n = filter->ramps.u8.red_size + filter->ramps.u8.green_size + filter->ramps.u8.blue_size;
+		if (!fade_endpoints[i]) {
+			fade_endpoints[i] = malloc(2 * n * sizeof(**fade_endpoints));
+			if (!fade_endpoints[i])
+				return -1;
+		}
+		if (from)
+			fill_endpoint(fade_endpoints[i], filter, from);
+		fill_endpoint(&fade_endpoints[i][n], filter, to[crtc_updates[i].group]);
+	}
+
+	return 0;
+}
+
+/**
+ * Fill a filter by blending its fade endpoints, for `fill_ramps`
+ * 
+ * @param  index  The index of the filter
+ * @param  w      The weight of the end colour for each channel
+ */
+static void
+fill_blend(size_t index, const double w[3])
+{
+	libcoopgamma_filter_t *filter = &crtc_updates[index].filter;
+	size_t n = filter->ramps.u8.red_size + filter->ramps.u8.green_size + filter->ramps.u8.blue_size;
+	blend_filter(filter, fade_endpoints[index], &fade_endpoints[index][n], w);
+}
+
+/**
+ * Get the colour of a colour temperature in linear RGB
+ * 
+ * @param   kelvin  The colour temperature
+ * @param   rgb     Output parameter for the red, green, and blue brightness
+ * @return          0 on success, -1 on failure
+ */
+static int
+get_linear_colour(double kelvin, double rgb[3])
+{
+	if (get_colour(kelvin, &rgb[0], &rgb[1], &rgb[2]))
+		return -1;
+	libclut_model_standard_to_linear(&rgb[0], &rgb[1], &rgb[2]);
+	return 0;
+}
+
+/**
+ * Prepare, if -n has been specified, for a fade: switch
+ * to real-time scheduling, or if that is not permitted,
+ * raise the process's priority, and lock the process's
+ * memory, so that frames are not delayed by other
+ * processes or by page faults
+ * 
+ * Failures are not fatal, they are only reported if
+ * -v has been specified
+ */
+static void
+enter_fade_scheduling(void)
+{
+	struct sched_param param;
+
+	if (!nflag)
+		return;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		if (verbose)
+			fprintf(stderr, "%s: cannot use real-time scheduling: %s\n", argv0, strerror(errno));
+		param.sched_priority = 0;
+		sched_setscheduler(0, SCHED_OTHER, &param);
+		if (setpriority(PRIO_PROCESS, 0, -10) && verbose)
+			fprintf(stderr, "%s: cannot raise process priority: %s\n", argv0, strerror(errno));
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) && verbose)
+		fprintf(stderr, "%s: cannot lock memory: %s\n", argv0, strerror(errno));
+}
+
+/**
+ * Leave, if -n has been specified, the scheduling
+ * set up by `enter_fade_scheduling` and switch to
+ * the idle scheduling policy for the steady state
+ * 
+ * Failures are not fatal, they are only reported if
+ * -v has been specified
+ */
+static void
+enter_steady_scheduling(void)
+{
+	struct sched_param param;
+
+	if (!nflag)
+		return;
+
+	munlockall();
+	memset(&param, 0, sizeof(param));
+	if (sched_setscheduler(0, SCHED_IDLE, &param) && verbose)
+		fprintf(stderr, "%s: cannot use idle scheduling: %s\n", argv0, strerror(errno));
+}
+
+/**
+ * Compute, and fill the filters with, a frame in the
+ * fade, without sending it
+ * 
+ * @param   elapsed                  The time, in milliseconds, since the fade started
+ * @param   duration                 The duration of the fade, in milliseconds
+ * @param   quantum                  The value returned by `ramp_quantum`
+ * @param   cost                     The time it takes, in milliseconds, to
+ *                                   compute and apply a frame
+ * @param   from                     The colour, in linear RGB, the fade starts at
+ * @param   to                       The colour, in linear RGB, the fade ends at,
+ *                                   indexed by profile; updated every six seconds
+ * @param   w                        Scratch space for the blend weights, indexed by profile
+ * @param   next_temperature_update  The value of `elapsed` when `to` shall be updated;
+ *                                   updated when it is
+ * @param   intervalp                Output parameter for the time, in milliseconds,
+ *                                   until the next frame
+ * @return                           0: Success
+ *                                   -1: Error, `errno` set
+ *                                   -2: Error, `cg->error` set
+ *                                   -3: Error, message already printed
+ */
+static int
+prepare_fade_frame(double elapsed, double duration, double quantum, double cost, const double from[3],
+                   double (*to)[3], double (*w)[3], double *next_temperature_update, double *intervalp)
+{
+	double kelvin, rgb[3], interval = INFINITY;
+	size_t ch, i;
+	int r;
+
+	if (elapsed >= *next_temperature_update) {
+		if ((r = get_temperatures()) < 0)
+			return r;
+		for (i = 0; i < profiles_n; i++)
+			if (profiles[i].used && get_linear_colour(profiles[i].temperature, to[i]))
+				return -1;
+		if (prepare_fade_endpoints(fade_endpoints ? NULL : from, (const double (*)[3])to))
+			return -1;
+		*next_temperature_update += 6000;
+	}
+
+	for (i = 0; i < profiles_n; i++) {
+		if (!profiles[i].used)
+			continue;
+		kelvin = 6500 - (6500 - profiles[i].temperature) * elapsed / duration;
+		if (get_linear_colour(kelvin, rgb))
+			return -1;
+		for (ch = 0; ch < 3; ch++)
+			w[i][ch] = fabs(to[i][ch] - from[ch]) > 1e-12 ? (rgb[ch] - from[ch]) / (to[i][ch] - from[ch]) : 0;
+		interval = fmin(interval, fade_interval(kelvin, 6500, profiles[i].temperature, duration, quantum, cost));
+	}
+
+	fill_ramps(fill_blend, (const double (*)[3])w);
+	*intervalp = interval;
+	return 0;
+}
+
+/**
+ * Fade in the effect, or the remainder
+ * of the fade-in if it was interrupted
+ * by a change of the CRTC configuration
+ * 
+ * The fade is pipelined: once a frame has been sent, the
+ * next frame is computed while the display server processes
+ * it, so the time per frame is the longer of the computation
+ * and the round trip rather than their sum
+ * 
+ * @return  0: Success
+ *          1: The CRTC configuration has changed
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
  *          -3: Error, message already printed
  */
-int
-start(void)
+static int
+fade_in(void)
+{
+	int r = 0, sent, tfd;
+	double duration = (double)fade_in_cs * 10;
+	double quantum = ramp_quantum();
+	double kelvin, from[3];
+	double (*to)[3], (*w)[3];
+	double start, elapsed = fade_in_elapsed, next, now, interval, next_interval = 0, t, cost = 0;
+	size_t first = 0;
+	double next_temperature_update = 0;
+	struct fade_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+
+	to = alloca(profiles_n * sizeof(*to));
+	w = alloca(profiles_n * sizeof(*w));
+	memset(w, 0, profiles_n * sizeof(*w));
+	while (!profiles[first].used)
+		first++;
+
+	if (verbose) {
+		stats.intervals = calloc((size_t)(duration * max_frame_rate / 1000) + 2, sizeof(*stats.intervals));
+		stats.lateness = calloc((size_t)(duration * max_frame_rate / 1000) + 2, sizeof(*stats.lateness));
+		if (!stats.intervals || !stats.lateness) {
+			free(stats.intervals);
+			free(stats.lateness);
+			return -1;
+		}
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (tfd < 0 || get_linear_colour(6500, from)) {
+		r = -1;
+		goto out;
+	}
+
+	start = clock_ms() - elapsed;
+	r = prepare_fade_frame(elapsed, duration, quantum, cost, from, to, w, &next_temperature_update, &interval);
+	if (r < 0)
+		goto out;
+	for (;;) {
+		kelvin = 6500 - (6500 - profiles[first].temperature) * elapsed / duration;
+		PROBE3(fade_tick, (size_t)elapsed, (size_t)duration, (long int)kelvin);
+		t = monotonic_ms();
+		if ((r = sent = send_ramps()) < 0)
+			goto out;
+
+		/* The ramps have been copied into the outbound messages,
+		 * so the next frame can be computed in their place while
+		 * the display server is processing this frame */
+		next = elapsed + interval;
+		if (next < duration) {
+			r = prepare_fade_frame(next, duration, quantum, cost, from, to, w,
+			                       &next_temperature_update, &next_interval);
+			if (r < 0)
+				goto out;
+		}
+
+		if ((r = await_ramps(sent)) < 0)
+			goto out;
+		fade_in_elapsed = elapsed;
+		t = monotonic_ms() - t;
+		cost = cost ? (3 * cost + t) / 4 : t;
+		if (verbose)
+			fade_stats_frame(&stats, clock_ms() - start, fade_in_cs, 6500, profiles[first].temperature, kelvin);
+		if ((r = ramps_applied()))
+			goto out;
+		alloc_check_start();
+		if (publish_status(kelvin)) {
+			r = -1;
+			goto out;
+		}
+		if (next >= duration)
+			break;
+
+		if (sleep_until(tfd, start + next)) {
+			r = -1;
+			goto out;
+		}
+		now = clock_ms() - start;
+		if (verbose)
+			stats.lateness[stats.frames - 1] = fmax(now - next, 0);
+		interval = fmax(next_interval, cost * 1.25);
+		if (now > next + interval) {
+			/* Too late for the prepared frame, compute a current one instead */
+			if (verbose)
+				stats.dropped += (uint64_t)((now - next) / interval);
+			if (now >= duration)
+				break;
+			r = prepare_fade_frame(now, duration, quantum, cost, from, to, w, &next_temperature_update, &interval);
+			if (r < 0)
+				goto out;
+			next = now;
+		}
+		elapsed = next;
+	}
+	fade_in_elapsed = duration;
+
+	if (verbose)
+		fade_stats_print(&stats);
+
+out:
+	if (tfd >= 0)
+		close(tfd);
+	free(stats.intervals);
+	free(stats.lateness);
+	release_fade_endpoints();
+	return r;
+}
+
+
+/**
+ * Get the number of seconds, for a profile that follows
+ * the Sun, that the Sun's elevation will at least remain
+ * below the profile's `.low_elev` or above its `.high_elev`,
+ * so that the colour temperature does not change
+ * 
+ * The Sun's elevation changes by at most 15 degrees per hour
+ * 
+ * @param   profile  The colour temperature settings
+ * @return           The number of seconds, 0 if the
+ *                   temperature is changing
+ */
+static double
+solar_clamp_time(const struct profile *profile)
+{
+	double jc, elevation;
+	jc = (wall_time() / 86400 + 2440587.5 - 2451545) / 36525;
+	elevation = libred_solar_elevation_from_time(jc, profile->latitude, profile->longitude);
+	if (elevation < profile->low_elev)
+		return (profile->low_elev - elevation) / 15 * 60 * 60;
+	if (elevation > profile->high_elev)
+		return (elevation - profile->high_elev) / 15 * 60 * 60;
+	return 0;
+}
+
+/**
+ * Get the time of the next update in the steady state
+ * 
+ * This is normally the next multiple of six seconds, but if
+ * no colour temperature is currently changing, because it
+ * is fixed with -t, because its schedule is not currently
+ * changing it, or because the Sun is below or above the
+ * elevations where it changes, it is the time the first
+ * temperature may start to change, or, if sooner, when the
+ * filters shall next be verified; if all temperatures are
+ * fixed, it is when the filters shall next be verified, or
+ * the next multiple of six seconds if they are not verified
+ * 
+ * If a filter update has failed, or a site's connection
+ * was lost, it is no later than the next retry, which
+ * is not rounded to whole seconds
+ * 
+ * @return  The time of the next update, in seconds
+ *          since the Epoch, of the time source
+ */
+static double
+next_update_time(void)
 {
-	int r, tfd;
+	double now = wall_time(), wait = INFINITY, t, kelvin;
+	int retry = retry_delay();
 	size_t i;
-	double temperature, red, green, blue;
+
+	for (i = 0; i < profiles_n; i++) {
+		if (!profiles[i].used || profiles[i].choosen_temperature >= 0)
+			continue;
+		if (profiles[i].schedule) {
+			t = schedule_lookup(&profiles[i], &kelvin);
+		} else {
+			t = solar_clamp_time(&profiles[i]);
+			if (t < 6)
+				t = 0;
+		}
+		if (!t)
+			goto tick;
+		wait = fmin(wait, t);
+	}
+	if (verify_interval)
+		wait = fmin(wait, verify_interval);
+	if (isinf(wait))
+		goto tick;
+	t = ceil(now + wait);
+	goto out;
+
+tick:
+	t = (floor(now / 6) + 1) * 6;
+out:
+	if (retry >= 0)
+		t = fmin(t, now + retry / 1000.);
+	return t;
+}
+
+/**
+ * Wait until a point in time on the wall clock,
+ * normally the next multiple of six seconds, or
+ * less if the wall clock is changed or the
+ * connection to a server is lost
+ * 
+ * Aligning the wakeups lets them share a CPU wakeup with other
+ * timers on the system, `poll`'s timeout is subject to the
+ * timer slack set with -s, and the timer, which has an absolute
+ * deadline on `CLOCK_REALTIME` the timer slack after the
+ * alignment boundary, bounds the delay; it expires immediately
+ * on resume from suspend if the deadline has passed, and it is
+ * cancelled if the clock is set, so that the colour temperature
+ * is updated at once
+ * 
+ * The connections to the servers are polled while waiting,
+ * so that a server that closes the connection, for example
+ * because it is restarted, is reconnected to at once,
+ * rather than at the next update
+ * 
+ * @param   tfd   A timer created with `timerfd_create(CLOCK_REALTIME, 0)`
+ * @param   when  The time to wait until, in seconds since the Epoch,
+ *                as returned by `next_update_time`
+ * @return        0: Success
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ */
+static int
+wait_for_next_update(int tfd, double when)
+{
+	struct itimerspec deadline;
+	struct timespec now;
+	struct pollfd *pollfds;
 	uint64_t overrun;
+	long int tolerance_ns = timer_slack > 0 ? (long int)(timer_slack * 1000000 + 0.5) : 0;
+	double timeout_ms;
+	size_t i;
+	int r;
+
+	if (clock_gettime(CLOCK_REALTIME, &now))
+		return -1;
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = (time_t)when;
+	deadline.it_value.tv_nsec = (long int)((when - (double)deadline.it_value.tv_sec) * 1000000000L);
+	timeout_ms = ceil((when - (double)now.tv_sec) * 1000 - (double)now.tv_nsec / 1000000);
+	if (timeout_ms < 0)
+		timeout_ms = 0;
+	deadline.it_value.tv_nsec += tolerance_ns;
+	deadline.it_value.tv_sec += deadline.it_value.tv_nsec / 1000000000L;
+	deadline.it_value.tv_nsec %= 1000000000L;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &deadline, NULL))
+		return -1;
+
+	pollfds = alloca((sites_n + 1) * sizeof(*pollfds));
+	pollfds[0].fd = tfd;
+	pollfds[0].events = POLLIN;
+	for (i = 0; i < sites_n; i++) {
+		pollfds[i + 1].fd = sites[i].disconnected ? -1 : sites[i].cg.fd;
+		pollfds[i + 1].events = POLLIN;
+	}
+
+	r = metrics_wait(pollfds, sites_n + 1, (int)timeout_ms);
+	if (r <= 0)
+		return r < 0 && errno != EINTR ? -1 : 0;
+
+	for (i = 0; i < sites_n; i++) {
+		if (pollfds[i + 1].revents) {
+			/* Nothing is pending in the steady state, so the
+			 * server has closed the connection; `synchronise`
+			 * reconnects and resends the site's filters, whose
+			 * replies are awaited so that the filters can be
+			 * verified at the next update */
+			r = synchronise(0);
+			while (!r)
+				r = synchronise(-1);
+			return r < 0 ? r : 0;
+		}
+	}
+
+	if (read(tfd, &overrun, sizeof(overrun)) < 0) {
+		if (errno == ECANCELED) {
+			if (verbose)
+				fprintf(stderr, "%s: clock changed, updating colour temperature\n", argv0);
+			return 0;
+		}
+		return errno == EINTR ? 0 : -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Spread a change of the colour temperatures, in the
+ * steady state, over `MICRO_TRANSITION_MS` milliseconds,
+ * or until the next update if it is sooner, by applying
+ * intermediate temperatures, at most `micro_rate` per
+ * second and about one per step of the blackbody table
+ * 
+ * The final temperatures, in `.temperature` of each
+ * element in `profiles`, are not applied
+ * 
+ * @param   tfd   A timer created with `timerfd_create(CLOCK_MONOTONIC, 0)`
+ * @param   from  For each element in `profiles`, the
+ *                currently applied colour temperature
+ * @return        0: Success
+ *                1: The CRTC configuration has changed
+ *                -1: Error, `errno` set
+ *                -2: Error, `cg->error` set
+ *                -3: Error, message already printed
+ */
+static int
+micro_transition(int tfd, const double *from)
+{
+	double (*rgb)[3];
+	double kelvin, shown, start, duration, interval, steps = 0;
+	size_t i, k, n;
+	int r;
+
+	duration = fmin(MICRO_TRANSITION_MS, (next_update_time() - wall_time()) * 1000);
+	for (i = 0; i < profiles_n; i++)
+		if (profiles[i].used)
+			steps = fmax(steps, ceil(fabs(profiles[i].temperature - from[i]) / BLACKBODY_STEP));
+	steps = fmin(steps, floor(micro_rate * duration / 1000));
+	if (steps < 2)
+		return 0;
+	n = (size_t)steps;
+	interval = duration / steps;
+
+	rgb = alloca(profiles_n * sizeof(*rgb));
+	for (i = 0; i < profiles_n; i++)
+		rgb[i][0] = rgb[i][1] = rgb[i][2] = 1;
+
+	start = clock_ms();
+	for (k = 1; k < n; k++) {
+		shown = NAN;
+		for (i = 0; i < profiles_n; i++) {
+			if (!profiles[i].used)
+				continue;
+			kelvin = from[i] + (profiles[i].temperature - from[i]) * (double)k / steps;
+			if (isnan(shown))
+				shown = kelvin;
+			if (get_colour(kelvin, &rgb[i][0], &rgb[i][1], &rgb[i][2]))
+				return -1;
+		}
+		if ((r = set_ramps(rgb)) < 0)
+			return r;
+		if ((r = ramps_applied()))
+			return r;
+		if (publish_status(shown))
+			return -1;
+		if (sleep_until(tfd, start + (double)k * interval))
+			return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Print, to stderr, a report of the simulation
+ * selected with -T, once it has finished
+ * 
+ * @return  0: Success
+ *          -3: Memory was allocated after initialisation,
+ *              the report has been printed
+ */
+static int
+simulation_report(void)
+{
+	double real_ms = monotonic_ms() - simulation_real_start;
+	struct rusage ru;
+	fprintf(stderr, "%s: simulation: 24 hours in %.3f s, %" PRIu64 " frames, %" PRIu64 " updates sent\n",
+	        argv0, real_ms / 1000, simulated_frames, simulated_updates);
+	fprintf(stderr, "%s: simulation: %.3f ms computing ramps, %.3f us per frame\n",
+	        argv0, simulated_compute_time * 1000,
+	        simulated_frames ? simulated_compute_time * 1000000 / (double)simulated_frames : 0.);
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(stderr, "%s: simulation: peak resident set size %ld kB\n", argv0, ru.ru_maxrss);
+#ifdef ALLOC_CHECK
+	fprintf(stderr, "%s: simulation: %" PRIu64 " memory allocations after initialisation\n",
+	        argv0, alloc_check_count());
+	if (alloc_check_count())
+		return -3;
+#endif
+	return 0;
+}
+
+
+/**
+ * The main function for the program-specific code
+ * 
+ * It is called again, after the filters have been
+ * reconfigured, if it returns 1; the status file,
+ * the metrics socket, and the simulation clock are
+ * then kept, and the fade-in is resumed
+ * 
+ * @return  0: Success
+ *          1: The CRTC configuration has changed
+ *          -1: Error, `errno` set
+ *          -2: Error, `cg->error` set
+ *          -3: Error, message already printed
+ */
+int
+start(void)
+{
+	static int reentered = 0;
+	int r, tfd = -1, mtfd = -1, have_applied = 0;
+	size_t i, first = 0;
+	double t, verified_ms = 0;
+	double (*rgb)[3], (*applied)[3], *applied_temperature;
+
+	rgb = alloca(profiles_n * sizeof(*rgb));
+	applied = alloca(profiles_n * sizeof(*applied));
+	applied_temperature = alloca(profiles_n * sizeof(*applied_temperature));
+	for (i = 0; i < profiles_n; i++)
+		rgb[i][0] = rgb[i][1] = rgb[i][2] = 1;
+
+	if (!xflag && !isnan(simulation_start)) {
+		dflag = 1;
+		if (!reentered)
+			simulation_real_start = monotonic_ms();
+	}
+
+	if (!xflag) {
+		select_profiles();
+		for (i = 0; i < profiles_n; i++)
+			if (profiles[i].used && profiles[i].choosen_temperature < 0)
+				dflag = 1;
+		while (!profiles[first].used)
+			first++;
+	}
 
 	if (xflag)
 		for (i = 0; i < filters_n; i++)
 			crtc_updates[i].filter.lifespan = LIBCOOPGAMMA_REMOVE;
-	else if (choosen_temperature >= 0 && !dflag)
+	else if (!dflag)
 		for (i = 0; i < filters_n; i++)
 			crtc_updates[i].filter.lifespan = LIBCOOPGAMMA_UNTIL_REMOVAL;
 	else
 		for (i = 0; i < filters_n; i++)
 			crtc_updates[i].filter.lifespan = LIBCOOPGAMMA_UNTIL_DEATH;
 
-	if (!xflag) {
-		if (libred_check_timetravel())
-			return -1;
-		if (choosen_temperature < 0)
-			dflag = 1;
+	if (!xflag && libred_check_timetravel())
+		return -1;
+
+	if (status_path && !reentered) {
+		if (status_start(status_path) < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv0, status_path, strerror(errno));
+			return -3;
+		}
+		if (signal(SIGHUP, terminate) == SIG_ERR ||
+		    signal(SIGINT, terminate) == SIG_ERR ||
+		    signal(SIGTERM, terminate) == SIG_ERR) {
+			r = -1;
+			goto out;
+		}
 	}
 
-	if (xflag)
-		return set_ramps(1, 1, 1);
+	if (oneshot) {
+		/* The filters have been sent by `fill_oneshot`'s caller,
+		 * but not all replies have necessarily been received */
+		if ((r = synchronise(0)) < 0 || (r = await_ramps(r)) < 0)
+			goto out;
+		if ((r = ramps_applied()))
+			goto out;
+		r = publish_status(xflag ? 6500 : profiles[first].temperature);
+		goto out;
+	}
 
 	if ((r = make_slaves()) < 0)
-		return r;
+		goto out;
 
-	if (!fade_in_cs)
-		goto no_fade_in;
-
-	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-	if (tfd < 0)
-		return -1;
-	if (timerfd_settime(tfd, 0, &(struct itimerspec){{0, 10000000L}, {0, 10000000L}}, NULL))
-		return -1;
-
-	for (i = 0; i < (size_t)fade_in_cs;) {
-		if (i % 600 == 0)
-			if ((r = get_temperature(&temperature)) < 0)
-				return r;
-		if (libred_get_colour((long int)(6500 - (6500 - temperature) * i / fade_in_cs), &red, &green, &blue))
-			return -1;
-		if ((r = set_ramps(red, green, blue)) < 0)
-			return r;
+	if (metrics_socket && (metrics_enabled ? metrics_reconfigure() : metrics_start(metrics_socket)) < 0) {
+		r = -1;
+		goto out;
+	}
 
-		if (read(tfd, &overrun, sizeof(overrun)) != sizeof(overrun))
-			return -1;
-		if (overrun > fade_in_cs - i)
-			overrun = fade_in_cs - i;
-		i += overrun;
+	if (fade_in_cs && fade_in_elapsed < (double)fade_in_cs * 10) {
+		enter_fade_scheduling();
+		if ((r = fade_in()))
+			goto out;
 	}
+	if (dflag)
+		enter_steady_scheduling();
 
-	close(tfd);
+	if (dflag) {
+		r = -1;
+		tfd = timerfd_create(isnan(simulation_start) ? CLOCK_REALTIME : CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (tfd < 0)
+			goto out;
+		if (timer_slack >= 0 && prctl(PR_SET_TIMERSLACK, timer_slack ? (unsigned long int)(timer_slack * 1000000 + 0.5) : 1UL))
+			goto out;
+		if (micro_rate && isnan(simulation_start)) {
+			mtfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+			if (mtfd < 0)
+				goto out;
+		}
+	}
 
-no_fade_in:
 	for (;;) {
-		if ((r = get_temperature(&temperature)) < 0)
-			return r;
-		if (libred_get_colour((long int)temperature, &red, &green, &blue))
-			return -1;
-		if ((r = set_ramps(red, green, blue)) < 0)
-			return r;
+		if ((r = get_temperatures()) < 0)
+			goto out;
+		for (i = 0; i < profiles_n; i++) {
+			if (profiles[i].used && get_colour(profiles[i].temperature, &rgb[i][0], &rgb[i][1], &rgb[i][2])) {
+				r = -1;
+				goto out;
+			}
+		}
+		if (micro_rate && have_applied && (r = micro_transition(mtfd >= 0 ? mtfd : tfd, applied_temperature)))
+			goto out;
+		if (verify_interval && have_applied && !memcmp(applied, rgb, profiles_n * sizeof(*rgb))) {
+			if ((r = retry_filters()) < 0)
+				goto out;
+			if (clock_ms() - verified_ms >= verify_interval * 1000) {
+				if ((r = verify_filters()) < 0)
+					goto out;
+				verified_ms = clock_ms();
+			}
+		} else {
+			memcpy(applied, rgb, profiles_n * sizeof(*rgb));
+			for (i = 0; i < profiles_n; i++)
+				applied_temperature[i] = profiles[i].temperature;
+			if ((r = set_ramps(rgb)) < 0)
+				goto out;
+			verified_ms = clock_ms();
+			have_applied = 1;
+			if (publish_status(profiles[first].temperature)) {
+				r = -1;
+				goto out;
+			}
+		}
+		if ((r = ramps_applied()))
+			goto out;
 
 		if (!dflag)
-			return 0;
+			goto out;
+		alloc_check_start();
 
-		sleep(6);
+		if (!isnan(simulation_start)) {
+			t = next_update_time();
+			if (t - simulation_start >= 24 * 60 * 60) {
+				r = simulation_report();
+				goto out;
+			}
+			if ((r = sleep_until(tfd, (t - simulation_start) * 1000)) < 0)
+				goto out;
+		} else if ((r = wait_for_next_update(tfd, next_update_time())) < 0) {
+			goto out;
+		}
 	}
+
+out:
+	if (tfd >= 0)
+		close(tfd);
+	if (mtfd >= 0)
+		close(mtfd);
+	if (r == 1)
+		reentered = 1;
+	else
+		status_stop();
+	return r;
 }
@@ -0,0 +1,99 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+
+
+
+/**
+ * The first bytes of a recording, followed by a `uint32_t`
+ * with the value `RECORDING_VERSION` in host byte order
+ */
+#define RECORDING_MAGIC "radharc-rec"
+
+/**
+ * The version of the recording format
+ */
+#define RECORDING_VERSION 1
+
+
+/**
+ * Record type: a filter is defined, the record is followed
+ * by `.name_len` bytes: the CRTC's name, a NUL byte, and
+ * the filter's class; `.hash` is the filter's priority
+ */
+#define RECORD_FILTER 0
+
+/**
+ * Record type: a filter update was sent,
+ * `.hash` is the hash of the ramps
+ */
+#define RECORD_SENT 1
+
+/**
+ * Record type: a filter update was replied to with success
+ */
+#define RECORD_REPLY 2
+
+/**
+ * Record type: a filter update was replied to with failure
+ */
+#define RECORD_FAILED 3
+
+
+
+/**
+ * A record in a recording of filter updates
+ */
+struct record
+{
+	/**
+	 * The number of nanoseconds, of `CLOCK_MONOTONIC`,
+	 * since the recording started
+	 */
+	uint64_t time_ns;
+
+	/**
+	 * The hash of the ramps, see `.type`
+	 */
+	uint64_t hash;
+
+	/**
+	 * The index of the filter
+	 */
+	uint32_t filter;
+
+	/**
+	 * The size of the red ramp
+	 */
+	uint32_t red_size;
+
+	/**
+	 * The size of the green ramp
+	 */
+	uint32_t green_size;
+
+	/**
+	 * The size of the blue ramp
+	 */
+	uint32_t blue_size;
+
+	/**
+	 * The gamma ramp type, a `libcoopgamma_depth_t`
+	 */
+	int8_t depth;
+
+	/**
+	 * The record type, `RECORD_FILTER`, `RECORD_SENT`,
+	 * `RECORD_REPLY`, or `RECORD_FAILED`
+	 */
+	uint8_t type;
+
+	/**
+	 * The number of bytes that follow the record
+	 */
+	uint16_t name_len;
+
+	/**
+	 * Should be 0
+	 */
+	uint32_t __padding;
+};
@@ -0,0 +1,648 @@
+/* See LICENSE file for copyright and license details. */
+#include "cg-base.h"
+#include "recording.h"
+
+#include <libclut.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+/**
+ * Prefix added to the class of each replayed filter,
+ * unless -k has been specified, so that the replay
+ * does not replace the filters of a running radharc
+ */
+#define CLASS_PREFIX "radharc-replay::"
+
+
+
+/**
+ * A filter from the recording
+ */
+struct replay_filter
+{
+	/**
+	 * The filter, as sent to the server
+	 */
+	libcoopgamma_filter_t filter;
+
+	/**
+	 * Whether `.filter` has been defined
+	 */
+	int defined;
+
+	/**
+	 * Whether the filter is waiting for a reply
+	 */
+	int pending;
+
+	/**
+	 * The time, on `CLOCK_MONOTONIC`, the filter was last sent
+	 */
+	struct timespec sent;
+
+	/**
+	 * The time, in the recording, the filter was last sent
+	 */
+	uint64_t recorded_sent;
+
+	/**
+	 * Whether the filter, in the recording,
+	 * is waiting for a reply
+	 */
+	int recorded_pending;
+};
+
+
+
+/**
+ * The process's name
+ */
+const char *argv0;
+
+/**
+ * The connection to the coopgamma server
+ */
+static libcoopgamma_context_t conn;
+
+/**
+ * Whether the filters shall be replayed with the recorded
+ * classes, replacing the filters of a running radharc, as
+ * specified with the -k flag
+ */
+static int keep_class = 0;
+
+/**
+ * The filters from the recording
+ */
+static struct replay_filter *replays = NULL;
+
+/**
+ * Contexts for asynchronous ramp updates,
+ * one per element in `replays`
+ */
+static libcoopgamma_async_context_t *asyncs = NULL;
+
+/**
+ * The number of elements in `replays` and `asyncs`
+ */
+static size_t replays_n = 0;
+
+/**
+ * The number of pending receives
+ */
+static size_t pending_recvs = 0;
+
+/**
+ * The number of updates that failed on the server
+ */
+static size_t failures = 0;
+
+/**
+ * Replayed latencies, in milliseconds
+ */
+static double *latencies = NULL;
+
+/**
+ * The number of elements in `latencies`
+ */
+static size_t latencies_n = 0;
+
+/**
+ * Recorded latencies, in milliseconds
+ */
+static double *recorded_latencies = NULL;
+
+/**
+ * The number of elements in `recorded_latencies`
+ */
+static size_t recorded_latencies_n = 0;
+
+
+
+/**
+ * Print usage information and exit
+ */
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-M method] [-S site] [-f] [-k] recording\n", argv0);
+	exit(1);
+}
+
+
+/**
+ * Get the number of milliseconds from one point in time to another
+ * 
+ * @param   a  The earlier point in time
+ * @param   b  The later point in time
+ * @return     The number of milliseconds from `a` to `b`
+ */
+static double
+elapsed_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (double)(b->tv_sec - a->tv_sec) * 1000 + (double)(b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+
+/**
+ * Append a latency to a list
+ * 
+ * @param   listp  Reference to the list
+ * @param   np     Reference to the number of elements in the list
+ * @param   ms     The latency, in milliseconds
+ * @return         Zero on success, -1 on error
+ */
+static int
+add_latency(double **listp, size_t *np, double ms)
+{
+	double *new;
+	if (!(*np & (*np + 1))) {
+		new = realloc(*listp, (*np * 2 + 1) * sizeof(**listp));
+		if (!new)
+			return -1;
+		*listp = new;
+	}
+	(*listp)[(*np)++] = ms;
+	return 0;
+}
+
+
+/**
+ * Define, or redefine, a filter
+ * 
+ * The filter's class is prefixed with `CLASS_PREFIX`
+ * unless -k has been specified
+ * 
+ * @param   rec   The record that defines the filter
+ * @param   name  The bytes that follow the record
+ * @return        Zero on success, -1 on error
+ */
+static int
+define_filter(const struct record *rec, const char *name)
+{
+	struct replay_filter *filter;
+	void *new;
+	size_t crtc_len, class_len, prefix_len;
+
+	crtc_len = strnlen(name, rec->name_len);
+	if (crtc_len == rec->name_len)
+		goto invalid;
+
+	if (rec->filter >= replays_n) {
+		new = realloc(replays, (rec->filter + 1) * sizeof(*replays));
+		if (!new)
+			return -1;
+		replays = new;
+		new = realloc(asyncs, (rec->filter + 1) * sizeof(*asyncs));
+		if (!new)
+			return -1;
+		asyncs = new;
+		memset(&replays[replays_n], 0, (rec->filter + 1 - replays_n) * sizeof(*replays));
+		for (; replays_n <= rec->filter; replays_n++)
+			if (libcoopgamma_async_context_initialise(&asyncs[replays_n]) < 0)
+				return -1;
+	}
+
+	filter = &replays[rec->filter];
+	if (filter->defined)
+		libcoopgamma_filter_destroy(&filter->filter);
+	filter->defined = 0;
+	filter->recorded_pending = 0;
+	if (libcoopgamma_filter_initialise(&filter->filter) < 0)
+		return -1;
+	filter->defined = 1;
+	filter->filter.crtc = strndup(name, crtc_len);
+	class_len = rec->name_len - crtc_len - 1;
+	prefix_len = keep_class ? 0 : sizeof(CLASS_PREFIX) - 1;
+	filter->filter.class = malloc(prefix_len + class_len + 1);
+	if (!filter->filter.crtc || !filter->filter.class)
+		return -1;
+	memcpy(filter->filter.class, CLASS_PREFIX, prefix_len);
+	memcpy(&filter->filter.class[prefix_len], &name[crtc_len + 1], class_len);
+	filter->filter.class[prefix_len + class_len] = '\0';
+	filter->filter.priority = (int64_t)rec->hash;
+	filter->filter.lifespan = LIBCOOPGAMMA_UNTIL_DEATH;
+	filter->filter.depth = (libcoopgamma_depth_t)rec->depth;
+	filter->filter.ramps.u8.red_size = rec->red_size;
+	filter->filter.ramps.u8.green_size = rec->green_size;
+	filter->filter.ramps.u8.blue_size = rec->blue_size;
+	switch (filter->filter.depth) {
+#define X(CONST, MEMBER, MAX, TYPE)\
+	case CONST:\
+		if (libcoopgamma_ramps_initialise(&filter->filter.ramps.MEMBER) < 0)\
+			return -1;\
+		libclut_start_over(&filter->filter.ramps.MEMBER, MAX, TYPE, 1, 1, 1);\
+		break;
+	LIST_DEPTHS
+#undef X
+	default:
+		goto invalid;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: recording is corrupt\n", argv0);
+	errno = 0;
+	return -1;
+}
+
+
+/**
+ * Receive the replies that are available
+ * 
+ * @return  0: Success
+ *          -1: Error, `errno` set
+ *          -2: Error, `conn.error` set
+ */
+static int
+receive(void)
+{
+	struct timespec now;
+	size_t selected;
+
+	for (;;) {
+		if (libcoopgamma_synchronise(&conn, asyncs, replays_n, &selected) < 0) {
+			if (!errno)
+				continue;
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (!replays[selected].pending)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		replays[selected].pending = 0;
+		pending_recvs -= 1;
+		if (add_latency(&latencies, &latencies_n, elapsed_ms(&replays[selected].sent, &now)) < 0)
+			return -1;
+		if (libcoopgamma_set_gamma_recv(&conn, &asyncs[selected]) < 0) {
+			if (!conn.error.server_side)
+				return -2;
+			failures += 1;
+		}
+	}
+}
+
+
+/**
+ * Wait until the connection is ready for I/O, and receive
+ * the replies that are available, and flush pending messages
+ * 
+ * @param   flush     Whether there are messages to flush
+ * @param   deadline  The time, on `CLOCK_MONOTONIC`, to wait until
+ *                    if nothing happens, `NULL` to wait forever
+ * @return            0: Success, `flush` is updated
+ *                    -1: Error, `errno` set
+ *                    -2: Error, `conn.error` set
+ */
+static int
+wait_io(int *flush, const struct timespec *deadline)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	double timeout = -1;
+	int r;
+
+	if (deadline) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = elapsed_ms(&now, deadline);
+		if (timeout < 0)
+			timeout = 0;
+	}
+
+	pfd.fd = conn.fd;
+	pfd.events = (short)((pending_recvs ? POLLIN : 0) | (*flush ? POLLOUT : 0));
+	pfd.revents = 0;
+	if (pfd.events) {
+		if (poll(&pfd, 1, deadline ? (int)timeout + 1 : -1) < 0 && errno != EINTR)
+			return -1;
+	} else if (deadline) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+	}
+
+	if (pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+		if (libcoopgamma_flush(&conn) < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+		} else {
+			*flush = 0;
+		}
+	}
+	if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+		if ((r = receive()))
+			return r;
+	return 0;
+}
+
+
+/**
+ * Replay the updates in a recording
+ * 
+ * @param   data  The recording, after the header
+ * @param   size  The number of bytes in `data`
+ * @param   fast  Whether the updates shall be sent as fast as
+ *                possible, rather than with the recorded timing
+ * @return        0: Success
+ *                -1: Error, `errno` set
+ *                -2: Error, `conn.error` set
+ */
+static int
+replay(const char *data, size_t size, int fast)
+{
+	struct record rec;
+	struct replay_filter *filter;
+	struct timespec start, deadline, now;
+	size_t off = 0;
+	int flush = 0, r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (off < size) {
+		if (size - off < sizeof(rec))
+			goto invalid;
+		memcpy(&rec, &data[off], sizeof(rec));
+		off += sizeof(rec);
+		if (size - off < rec.name_len)
+			goto invalid;
+
+		if (rec.type == RECORD_FILTER) {
+			while (pending_recvs || flush)
+				if ((r = wait_io(&flush, NULL)))
+					return r;
+			if (define_filter(&rec, &data[off]) < 0)
+				return -1;
+			off += rec.name_len;
+			continue;
+		}
+		if (rec.filter >= replays_n || !replays[rec.filter].defined)
+			goto invalid;
+		filter = &replays[rec.filter];
+
+		if (rec.type != RECORD_SENT) {
+			if (filter->recorded_pending) {
+				filter->recorded_pending = 0;
+				if (add_latency(&recorded_latencies, &recorded_latencies_n,
+				                (double)(rec.time_ns - filter->recorded_sent) / 1000000) < 0)
+					return -1;
+			}
+			continue;
+		}
+		filter->recorded_sent = rec.time_ns;
+		filter->recorded_pending = 1;
+
+		if (!fast) {
+			deadline.tv_sec = start.tv_sec + (time_t)(rec.time_ns / 1000000000);
+			deadline.tv_nsec = start.tv_nsec + (long int)(rec.time_ns % 1000000000);
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec += 1;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			for (;;) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (elapsed_ms(&now, &deadline) <= 0)
+					break;
+				if ((r = wait_io(&flush, &deadline)))
+					return r;
+			}
+		}
+		while (filter->pending)
+			if ((r = wait_io(&flush, NULL)))
+				return r;
+
+		filter->pending = 1;
+		pending_recvs += 1;
+		clock_gettime(CLOCK_MONOTONIC, &filter->sent);
+		if (libcoopgamma_set_gamma_send(&filter->filter, &conn, &asyncs[rec.filter]) < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			flush = 1;
+		}
+	}
+
+	while (pending_recvs || flush)
+		if ((r = wait_io(&flush, NULL)))
+			return r;
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: recording is corrupt\n", argv0);
+	errno = 0;
+	return -1;
+}
+
+
+/**
+ * Compare two `double`:s, for `qsort`
+ * 
+ * @param   a  The first value
+ * @param   b  The second value
+ * @return     -1 if `*a < *b`, 1 if `*a > *b`, 0 otherwise
+ */
+static int
+double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Print latency percentiles
+ * 
+ * @param  label  The label to print before the percentiles
+ * @param  list   The latencies, in milliseconds, will be sorted
+ * @param  n      The number of elements in `list`
+ */
+static void
+print_latencies(const char *label, double *list, size_t n)
+{
+	if (!n) {
+		printf("%-10s %10s %10s %10s %10s\n", label, "-", "-", "-", "-");
+		return;
+	}
+	qsort(list, n, sizeof(*list), double_cmp);
+	printf("%-10s %10.3f %10.3f %10.3f %10.3f\n", label,
+	       list[(n - 1) * 50 / 100], list[(n - 1) * 90 / 100], list[(n - 1) * 99 / 100], list[n - 1]);
+}
+
+
+/**
+ * Read a file into memory
+ * 
+ * @param   path   The pathname of the file
+ * @param   sizep  Output parameter for the size of the file
+ * @return         The content of the file, `NULL` on error
+ */
+static char *
+read_file(const char *path, size_t *sizep)
+{
+	FILE *f;
+	char *data = NULL, *new;
+	size_t size = 0, got;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	for (;;) {
+		new = realloc(data, size + 8192);
+		if (!new)
+			goto fail;
+		data = new;
+		got = fread(&data[size], 1, 8192, f);
+		size += got;
+		if (got < 8192)
+			break;
+	}
+	if (ferror(f))
+		goto fail;
+	fclose(f);
+	*sizep = size;
+	return data;
+
+fail:
+	free(data);
+	fclose(f);
+	return NULL;
+}
+
+
+/**
+ * Replay a recording, made with radharc's -w option,
+ * of gamma ramp updates against a coopgamma server,
+ * and report the throughput and latencies
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        0 on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	const char *method = NULL, *site = NULL, *value, *path;
+	char *data = NULL, *arg;
+	size_t size, i, header = sizeof(RECORDING_MAGIC) + sizeof(uint32_t);
+	uint32_t version;
+	struct timespec start, end;
+	double duration;
+	int fast = 0, stage = 0, rc = 0, r;
+
+	argv0 = *argv++, argc--;
+	for (; *argv && argv[0][0] == '-' && argv[0][1]; argv++, argc--) {
+		if (!strcmp(*argv, "--")) {
+			argv++, argc--;
+			break;
+		}
+		for (arg = &argv[0][1]; *arg; arg++) {
+			if (*arg == 'f') {
+				fast = 1;
+				continue;
+			}
+			if (*arg == 'k') {
+				keep_class = 1;
+				continue;
+			}
+			if (*arg != 'M' && *arg != 'S')
+				usage();
+			if (arg[1]) {
+				value = &arg[1];
+			} else if (argv[1]) {
+				value = *++argv;
+				argc--;
+			} else {
+				usage();
+			}
+			if (*arg == 'M') {
+				if (method)
+					usage();
+				method = value;
+			} else {
+				if (site)
+					usage();
+				site = value;
+			}
+			break;
+		}
+	}
+	if (argc != 1)
+		usage();
+	path = *argv;
+
+	data = read_file(path, &size);
+	if (!data) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+		goto custom_fail;
+	}
+	if (size < header || memcmp(data, RECORDING_MAGIC, sizeof(RECORDING_MAGIC))) {
+		fprintf(stderr, "%s: %s: not a radharc recording\n", argv0, path);
+		goto custom_fail;
+	}
+	memcpy(&version, &data[sizeof(RECORDING_MAGIC)], sizeof(version));
+	if (version != RECORDING_VERSION) {
+		fprintf(stderr, "%s: %s: unsupported recording version: %" PRIu32 "\n", argv0, path, version);
+		goto custom_fail;
+	}
+
+	if (libcoopgamma_context_initialise(&conn) < 0)
+		goto fail;
+	stage++;
+	if (libcoopgamma_connect(method, site, &conn) < 0) {
+		fprintf(stderr, "%s: server failed to initialise\n", argv0);
+		goto custom_fail;
+	}
+	stage++;
+	if (libcoopgamma_set_nonblocking(&conn, 1) < 0)
+		goto fail;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = replay(&data[header], size - header, fast);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (r == -1)
+		goto fail;
+	if (r == -2) {
+		fprintf(stderr, "%s: %s-side error: %s\n", argv0, conn.error.server_side ? "server" : "client",
+		        conn.error.description ? conn.error.description : strerror((int)conn.error.number));
+		goto custom_fail;
+	}
+
+	duration = elapsed_ms(&start, &end);
+	printf("updates:    %zu (%zu failed)\n", latencies_n, failures);
+	printf("duration:   %.3f ms\n", duration);
+	printf("throughput: %.1f updates/s\n", duration > 0 ? (double)latencies_n * 1000 / duration : 0.0);
+	printf("%-10s %10s %10s %10s %10s\n", "latency/ms", "p50", "p90", "p99", "max");
+	print_latencies("recorded", recorded_latencies, recorded_latencies_n);
+	print_latencies("replayed", latencies, latencies_n);
+	if (fflush(stdout) || ferror(stdout))
+		goto fail;
+
+done:
+	for (i = 0; i < replays_n; i++) {
+		if (replays[i].defined)
+			libcoopgamma_filter_destroy(&replays[i].filter);
+		libcoopgamma_async_context_destroy(&asyncs[i]);
+	}
+	free(replays);
+	free(asyncs);
+	free(latencies);
+	free(recorded_latencies);
+	free(data);
+	if (stage)
+		libcoopgamma_context_destroy(&conn, stage > 1);
+	return rc;
+
+custom_fail:
+	rc = 1;
+	goto done;
+
+fail:
+	rc = 1;
+	if (errno)
+		perror(argv0);
+	goto done;
+}
@@ -0,0 +1,147 @@
+/* See LICENSE file for copyright and license details. */
+#include "status.h"
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/**
+ * The memory-mapped file the state is published in, `NULL` if none
+ */
+static struct status *status = NULL;
+
+
+
+/**
+ * Begin an update of `status`
+ */
+static void
+begin_update(void)
+{
+	uint64_t seq = __atomic_load_n(&status->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->sequence, seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/**
+ * Finish an update of `status`
+ */
+static void
+end_update(void)
+{
+	uint64_t seq = __atomic_load_n(&status->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&status->sequence, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Create, or reuse, and map the file the state
+ * shall be published in
+ * 
+ * @param   path  The pathname of the file
+ * @return        Zero on success, -1 on error
+ */
+int
+status_start(const char *path)
+{
+	int fd, saved_errno;
+	void *map;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, (off_t)sizeof(*status)))
+		goto fail;
+	map = mmap(NULL, sizeof(*status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	close(fd);
+
+	/* The sequence number is kept if the file is reused, so
+	 * that a reader of the old state notices the change */
+	status = map;
+	begin_update();
+	status->generation = 0;
+	status->time_ns = 0;
+	status->version = STATUS_VERSION;
+	status->pid = (int32_t)getpid();
+	status->temperature = 0;
+	status->elevation = 0;
+	status->red = 0;
+	status->green = 0;
+	status->blue = 0;
+	end_update();
+	return 0;
+
+fail:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Publish a new state, this is a no-op
+ * unless `status_start` has been called
+ * 
+ * @param  temperature  The colour temperature, in kelvins
+ * @param  elevation    The Sun's elevation, in degrees, NaN if not used
+ * @param  red          The red brightness of the colour temperature
+ * @param  green        The green brightness of the colour temperature
+ * @param  blue         The blue brightness of the colour temperature
+ */
+void
+status_publish(double temperature, double elevation, double red, double green, double blue)
+{
+	struct timespec now;
+
+	if (!status)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	begin_update();
+	status->generation += 1;
+	status->time_ns = (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_nsec;
+	status->temperature = temperature;
+	status->elevation = elevation;
+	status->red = red;
+	status->green = green;
+	status->blue = blue;
+	end_update();
+}
+
+
+/**
+ * Mark the published state as stale, by setting
+ * `.pid` to 0, and unmap the file, this is a no-op
+ * unless `status_start` has been called
+ * 
+ * May be called from a signal handler
+ */
+void
+status_stop(void)
+{
+	struct status *s = status;
+
+	if (!s)
+		return;
+	status = NULL;
+
+	/* If called from a signal handler in the middle of
+	 * an update, the sequence number is left odd, which
+	 * also marks the state as stale */
+	if (!(__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) & 1)) {
+		status = s;
+		begin_update();
+		status->pid = 0;
+		end_update();
+		status = NULL;
+	}
+	munmap(s, sizeof(*s));
+}
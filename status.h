@@ -0,0 +1,34 @@
+/* See LICENSE file for copyright and license details. */
+#include "radharc-status.h"
+
+
+
+/**
+ * Create, or reuse, and map the file the state
+ * shall be published in
+ * 
+ * @param   path  The pathname of the file
+ * @return        Zero on success, -1 on error
+ */
+int status_start(const char *path);
+
+/**
+ * Publish a new state, this is a no-op
+ * unless `status_start` has been called
+ * 
+ * @param  temperature  The colour temperature, in kelvins
+ * @param  elevation    The Sun's elevation, in degrees, NaN if not used
+ * @param  red          The red brightness of the colour temperature
+ * @param  green        The green brightness of the colour temperature
+ * @param  blue         The blue brightness of the colour temperature
+ */
+void status_publish(double temperature, double elevation, double red, double green, double blue);
+
+/**
+ * Mark the published state as stale, by setting
+ * `.pid` to 0, and unmap the file, this is a no-op
+ * unless `status_start` has been called
+ * 
+ * May be called from a signal handler
+ */
+void status_stop(void);